@@ -20,6 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#define _GNU_SOURCE 1
+
+#if defined(__linux__)
+#define HAVE_RECVMMSG
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -32,12 +38,18 @@ THE SOFTWARE.
 #include <sys/time.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include "ahcpd.h"
 #include "monotonic.h"
@@ -47,9 +59,115 @@ THE SOFTWARE.
 #include "config.h"
 #include "configure.h"
 #include "lease.h"
+#include "replication.h"
+#include "event.h"
+#include "ring.h"
+#include "capture.h"
 
 #define BUFFER_SIZE 2048
 
+/* Incoming datagrams are read in batches into a ring of buffers, and
+   then handled one per iteration of the main loop without waiting for
+   events (epoll, or select where that is missing; see event.c). */
+#define RECV_BATCH 32
+static unsigned char recv_buf[RECV_BATCH][BUFFER_SIZE];
+static struct sockaddr_in6 recv_sin[RECV_BATCH];
+static int recv_len[RECV_BATCH];
+static int recv_ifindex[RECV_BATCH];
+static struct in6_addr recv_dst[RECV_BATCH];
+static unsigned char
+recv_cmsg[RECV_BATCH][CMSG_SPACE(sizeof(struct in6_pktinfo)) +
+                      CMSG_SPACE(sizeof(unsigned int))];
+static int recv_count = 0, recv_next = 0;
+static int recv_domain = 0;     /* the domain the ring was filled from */
+static struct timeval recv_time[RECV_BATCH];
+
+/* Received datagrams can be captured to a file with -w, and a capture
+   replayed with -r (at the original pace) or -R (as fast as possible)
+   instead of reading from the network.  Replay measures the time from
+   when a packet is read until the main loop is done with it or, for a
+   client message, until the server has replied to it. */
+
+static char *capture_file = NULL, *replay_file = NULL;
+static int replay_fast = 0;
+static struct capture_record replay_rec;
+static unsigned char replay_buf[BUFFER_SIZE];
+static int replay_pending = 0;  /* replay_rec holds the next packet */
+static struct timeval replay_start, replay_first;
+static int replay_handling = 0;
+static struct timeval replay_since;
+static unsigned long replay_count = 0, replay_samples = 0;
+static long long replay_latency = 0, replay_max = 0;
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Client messages are queued by class and handled in priority order:
+   releases and requests from clients that hold a lease, then other
+   requests, then discoveries.  Only SERVER_BUDGET messages are handled
+   per batch of received packets, so that the queue builds up, and is
+   reordered, when the server is overloaded. */
+
+static int server_queued = 0;
+static unsigned long server_shed = 0;
+
+/* With lease-thread, the queue above and the lease database belong to a
+   worker thread.  Client messages are passed to it through one ring and
+   replies come back through another; a pipe in each direction is used
+   for wakeups.  The main thread still does all the sending. */
+
+static int lease_thread = 0;
+
+/* When several server processes share the port, each one handles the
+   clients whose id hashes to its shard index.  Unicast is steered to the
+   right process by the kernel, multicast is seen by all of them. */
+
+static int shard_count = 1;
+
+#ifndef NO_SERVER
+
+static int shard_index = 0;
+
+#define SERVER_QUEUE_MAX 256
+#define SERVER_BUDGET 8
+
+#define CLASS_KNOWN 0
+#define CLASS_REQUEST 1
+#define CLASS_DISCOVER 2
+#define NUM_CLASSES 3
+
+struct server_message {
+    unsigned char *buf;
+    int len;
+    struct sockaddr_in6 sin6;
+    int net, ll, ifindex;
+    struct timeval received;    /* when replaying */
+    struct server_message *next;
+};
+
+static struct server_message *server_queue[NUM_CLASSES];
+static struct server_message *server_queue_tail[NUM_CLASSES];
+
+/* A reply from the lease thread.  If alarm is not -1, this is instead a
+   high-water alarm, and data holds the pool name and percentage. */
+struct server_reply {
+    struct sockaddr_in6 sin6;
+    unsigned char dest[8];
+    int hopcount;
+    int alarm;
+    unsigned char *data;
+    int len;
+};
+
+static pthread_t worker;
+static struct ring to_worker, from_worker;
+static int worker_pipe[2] = {-1, -1}, reply_pipe[2] = {-1, -1};
+static int worker_stop = 0, worker_dump = 0, worker_wakeup = 0;
+static unsigned long worker_dropped = 0;
+
+/* Messages handed to the server, and those it is done with.  The latter
+   is written by the lease thread if there is one. */
+static unsigned long messages_queued = 0, messages_done = 0;
+#endif
+
 struct timeval now;
 const struct timeval zero = {0, 0};
 
@@ -57,6 +175,8 @@ static volatile sig_atomic_t exiting = 0, dumping = 0, changed = 0;
 struct in6_addr protocol_group;
 unsigned int protocol_port = 5359;
 int protocol_socket = -1;
+struct domain domains[MAXDOMAINS];
+int numdomains = 0;
 unsigned char myid[8];
 char *unique_id_file = "/var/lib/ahcpd-unique-id";
 int nodns = 0, af = 3, request_prefix_delegation = 0;
@@ -71,6 +191,10 @@ char *logfile = NULL, *pidfile = "/var/run/ahcpd.pid";
 struct network networks[MAXNETWORKS];
 int numnetworks;
 char *interfaces[MAXNETWORKS + 1];
+
+/* Maps small ifindices to an index into networks, or -1. */
+#define MAX_IFINDEX 256
+static int network_table[MAX_IFINDEX];
 struct timeval check_networks_time = {0, 0};
 
 struct timeval message_time = {0, 0};
@@ -81,10 +205,21 @@ const unsigned char ones[16] =
      0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
     };
 
-static void init_signals(void);
+static int init_signals(void);
 static int check_network(struct network *net);
+static void update_network_table(void);
+static int find_network(int ifindex);
+static int ready_domain(void);
+static void replay_due_time(struct timeval *due);
+static int replay_due(void);
+static void capture_batch(int n);
+static int replay_batch(void);
+static void replay_account(const struct timeval *since);
+static int replay_idle(void);
+static void replay_report(void);
 int ahcp_socket(int port);
-int ahcp_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen);
+static int ahcp_recv_batch(int s);
+static void log_kernel_drops(void);
 static int send_unicast_packet(unsigned char *server_id,
                                struct config_data *config, int index,
                                void *buf, int buflen);
@@ -92,7 +227,20 @@ int timeval_compare(const struct timeval *s1, const struct timeval *s2);
 static int reopen_logfile(void);
 static int daemonise(void);
 static void set_timeout(int which, int msecs, int override);
-unsigned roughly(unsigned value);
+#ifndef NO_SERVER
+static int init_pools(struct server_config *sc);
+static int queue_server_message(const unsigned char *buf, int len,
+                                 const struct sockaddr_in6 *sin6,
+                                 int net, int ll);
+static void run_server_queue(void);
+static int start_lease_thread(void);
+static void stop_lease_thread(void);
+static void wakeup(int fd);
+static void receive_replies(void);
+static int shard_of(const unsigned char *id);
+static struct server_config *find_server_config(int net,
+                                                const unsigned char *ipv4);
+#endif
 
 /* Client states */
 
@@ -111,7 +259,7 @@ main(int argc, char **argv)
     char *multicast = "ff02::cca6:c0f9:e182:5359";
     char *config_file = NULL;
     struct sockaddr_in6 sin6;
-    int opt, fd, rc, i, net;
+    int opt, fd, rc, i, net, status;
     unsigned int seed;
     enum state state = STATE_IDLE;
     int count = 0;
@@ -122,7 +270,7 @@ main(int argc, char **argv)
 
     
     while(1) {
-        opt = getopt(argc, argv, "m:p:nN46s:d:i:t:P:c:C:DL:I:");
+        opt = getopt(argc, argv, "m:p:nN46s:d:i:t:P:c:C:DL:I:k:w:r:R:");
         if(opt < 0)
             break;
 
@@ -184,6 +332,19 @@ main(int argc, char **argv)
         case 'I':
             pidfile = optarg;
             break;
+        case 'w':
+            capture_file = optarg;
+            break;
+        case 'r':
+        case 'R':
+            replay_file = optarg;
+            replay_fast = opt == 'R';
+            break;
+        case 'k':
+            flood_threshold = atoi(optarg);
+            if(flood_threshold < 0)
+                goto usage;
+            break;
         default:
             goto usage;
         }
@@ -216,6 +377,38 @@ main(int argc, char **argv)
     if(rc <= 0)
         goto usage;
 
+    memcpy(&domains[0].group, &protocol_group, 16);
+    domains[0].port = protocol_port;
+    numdomains = 1;
+    for(i = 0; i < num_extra_domains; i++) {
+        struct domain *domain = &domains[numdomains];
+        int j;
+        rc = inet_pton(AF_INET6, domain_groups[i], &domain->group);
+        if(rc <= 0 || !IN6_IS_ADDR_MULTICAST(&domain->group)) {
+            fprintf(stderr, "Couldn't parse domain group %s.\n",
+                    domain_groups[i]);
+            exit(1);
+        }
+        domain->port = domain_ports[i];
+        /* Unicast cannot be demultiplexed otherwise. */
+        for(j = 0; j < numdomains; j++) {
+            if(domains[j].port == domain->port) {
+                fprintf(stderr, "Domains must use distinct ports.\n");
+                exit(1);
+            }
+        }
+        numdomains++;
+    }
+
+    for(i = 0; i < num_relay_addresses; i++) {
+        rc = relay_add(relay_addresses[i], protocol_port);
+        if(rc < 0) {
+            fprintf(stderr, "Couldn't parse relay address %s.\n",
+                    relay_addresses[i]);
+            exit(1);
+        }
+    }
+
     time_init();
 
     if(do_daemonise) {
@@ -339,33 +532,139 @@ main(int argc, char **argv)
 
     if(server_config) {
 #ifndef NO_SERVER
-        if(server_config->lease_first[0] != 0) {
+        struct interface_config *iface;
+        int leases = 0;
+
+        rc = init_pools(server_config);
+        if(rc > 0)
+            leases = 1;
+        for(iface = interface_configs; iface && rc >= 0; iface = iface->next) {
+            if(iface->server_config)
+                rc = init_pools(iface->server_config);
+            if(rc > 0)
+                leases = 1;
+        }
+        if(rc < 0) {
+            fprintf(stderr, "Couldn't initialise address pools.\n");
+            goto fail;
+        }
+
+        if(leases) {
             if(server_config->lease_dir == NULL) {
                 fprintf(stderr, "No lease directory configured!\n");
                 goto fail;
             }
-            rc = lease_init(server_config->lease_dir,
-                            server_config->lease_first,
-                            server_config->lease_last,
-                            debug >= 2);
+            high_water_script = server_config->high_water_script;
+            rc = lease_init(server_config->lease_dir, debug >= 2);
             if(rc < 0) {
                 fprintf(stderr, "Couldn't initialise lease database.\n");
                 goto fail;
             }
         }
+
+        if(server_config->shard_count > 1) {
+            shard_index = server_config->shard_index;
+            shard_count = server_config->shard_count;
+            /* Every shard gets a copy of multicast packets, but only
+               one forwards them. */
+            if(shard_index > 0)
+                forward_multicast = 0;
+        }
+
+        if(server_config->replication_role != REPLICATION_NONE) {
+            if(replay_file) {
+                fprintf(stderr, "Replication doesn't work with -r.\n");
+                goto fail;
+            }
+            if(server_config->lease_thread) {
+                fprintf(stderr,
+                        "Replication doesn't work with lease-thread.\n");
+                goto fail;
+            }
+            if(!leases || server_config->replication_peer == NULL) {
+                fprintf(stderr, "Replication needs leases and a peer.\n");
+                goto fail;
+            }
+            rc = replication_init(server_config->replication_role,
+                                  server_config->replication_peer,
+                                  server_config->replication_peer_port,
+                                  server_config->replication_port ?
+                                  server_config->replication_port :
+                                  server_config->replication_peer_port);
+            if(rc < 0) {
+                perror("replication_init");
+                goto fail;
+            }
+        }
 #else
         abort();
 #endif
     }
 
-    protocol_socket = ahcp_socket(protocol_port);
-    if(protocol_socket < 0) {
-        perror("ahcp_socket");
+    rc = event_init();
+    if(rc < 0) {
+        perror("event_init");
         goto fail;
     }
 
+    /* A replay never touches the network. */
+    for(i = 0; i < numdomains; i++) {
+        domains[i].socket = -1;
+        if(replay_file)
+            continue;
+        domains[i].socket = ahcp_socket(domains[i].port);
+        if(domains[i].socket < 0) {
+            perror("ahcp_socket");
+            goto fail;
+        }
+        rc = event_add(domains[i].socket);
+        if(rc < 0) {
+            perror("event_add");
+            goto fail;
+        }
+    }
+    protocol_socket = domains[0].socket;
+
+    if(capture_file) {
+        rc = capture_open(capture_file);
+        if(rc < 0) {
+            perror("capture_open");
+            goto fail;
+        }
+    }
+
+    if(replay_file) {
+        rc = replay_open(replay_file);
+        if(rc < 0) {
+            perror("replay_open");
+            goto fail;
+        }
+        replay_pending =
+            replay_read(&replay_rec, replay_buf, BUFFER_SIZE) > 0;
+        replay_first = replay_rec.time;
+        gettime(&replay_start, NULL);
+    }
+
+    if(replication_socket >= 0) {
+        rc = event_add(replication_socket);
+        if(rc < 0) {
+            perror("event_add");
+            goto fail;
+        }
+    }
+
     for(i = 0; i < numnetworks; i++) {
+        struct interface_config *iface;
         networks[i].ifname = interfaces[i];
+        iface = find_interface_config(interfaces[i]);
+        networks[i].server_config =
+            iface && iface->server_config ?
+            iface->server_config : server_config;
+        networks[i].forward = iface ? iface->forward : 1;
+        if(iface && iface->split_horizon >= 0)
+            networks[i].split_horizon = iface->split_horizon;
+        else
+            networks[i].split_horizon = iface ? iface->wired : 0;
         check_network(&networks[i]);
         if(networks[i].ifindex <= 0) {
             fprintf(stderr, "Warning: unknown interface %s.\n",
@@ -373,8 +672,23 @@ main(int argc, char **argv)
             continue;
         }
     }
+    update_network_table();
+
+    rc = init_signals();
+    if(rc < 0) {
+        perror("init_signals");
+        goto fail;
+    }
 
-    init_signals();
+#ifndef NO_SERVER
+    if(server_config && server_config->lease_thread) {
+        rc = start_lease_thread();
+        if(rc < 0) {
+            perror("start_lease_thread");
+            goto fail;
+        }
+    }
+#endif
     set_timeout(CHECK_NETWORKS, 30000, 1);
 
     /* The client state machine. */
@@ -398,14 +712,24 @@ main(int argc, char **argv)
     debugf(2, "Entering main loop.\n");
 
     while(1) {
-        fd_set readfds;
         struct timeval tv;
 
         assert((config_data != NULL) == (state == STATE_BOUND ||
                                          state == STATE_RENEWING_UNICAST ||
                                          state == STATE_RENEWING));
 
-        FD_ZERO(&readfds);
+        if(replay_handling) {
+            replay_account(&replay_since);
+            replay_handling = 0;
+        }
+
+        if(replay_file && !replay_pending && recv_next >= recv_count &&
+           replay_idle()) {
+            replay_report();
+            break;
+        }
+
+        event_reset();
 
         tv = check_networks_time;
         timeval_min(&tv, &message_time);
@@ -414,18 +738,27 @@ main(int argc, char **argv)
             if(state == STATE_BOUND)
                 timeval_min_sec(&tv, config_renew_time());
         }
+        replication_timeout(&tv);
+        transport_timeout(&tv);
+        if(replay_pending && !replay_fast) {
+            struct timeval due;
+            replay_due_time(&due);
+            timeval_min(&tv, &due);
+        }
 
         gettime(&now, NULL);
 
-        if(timeval_compare(&tv, &now) > 0) {
+        if(recv_next < recv_count || replay_due() ||
+           (!lease_thread && server_queued > 0 && send_queue_space() > 0)) {
+            /* There are buffered packets, don't sleep. */
+        } else if(timeval_compare(&tv, &now) > 0) {
             timeval_minus(&tv, &tv, &now);
 
-            FD_SET(protocol_socket, &readfds);
             debugf(3, "Sleeping for %d.%03ds, state=%d.\n",
                    (int)tv.tv_sec, (int)(tv.tv_usec / 1000), (int)state);
-            rc = select(protocol_socket + 1, &readfds, NULL, NULL, &tv);
+            rc = event_wait(&tv);
             if(rc < 0 && errno != EINTR) {
-                perror("select");
+                perror("event_wait");
                 sleep(5);
                 continue;
             }
@@ -440,14 +773,51 @@ main(int argc, char **argv)
             int clock_status;
             time_t stable;
             struct timeval tv, real;
+            int rcvbuf = 0;
+            socklen_t rcvbuflen = sizeof(rcvbuf);
             dumping = 0;
             get_real_time(&real, &clock_status);
             gettime(&tv, &stable);
             printf("Clock status %d, stable for at least %ld seconds.\n",
                    (int)clock_status, (long)stable);
             printf("Forwarder forwarding.\n");
-            if(server_config)
-                printf("Server serving.\n");
+            for(i = 0; i < numdomains; i++) {
+                char a[INET6_ADDRSTRLEN];
+                inet_ntop(AF_INET6, &domains[i].group, a, sizeof(a));
+                rc = getsockopt(domains[i].socket, SOL_SOCKET, SO_RCVBUF,
+                                &rcvbuf, &rcvbuflen);
+                printf("Domain %s port %u: receive buffer %d bytes, "
+                       "%u dropped by the kernel.\n",
+                       a, domains[i].port, rc >= 0 ? rcvbuf : -1,
+                       domains[i].kernel_dropped);
+            }
+            rate_dump();
+            for(i = 0; i < numnetworks; i++) {
+                if(networks[i].ifindex <= 0)
+                    continue;
+                printf("Interface %s: %lu multicast, %lu unicast received.\n",
+                       networks[i].ifname,
+                       networks[i].multicast_received,
+                       networks[i].unicast_received);
+            }
+            if(server_config) {
+                printf("Server %s.\n",
+                       replication_serving() ? "serving" : "standing by");
+#ifndef NO_SERVER
+                if(lease_thread) {
+                    /* The lease thread dumps its own state. */
+                    printf("Lease thread: %lu dropped.\n", worker_dropped);
+                    __atomic_store_n(&worker_dump, 1, __ATOMIC_RELEASE);
+                    wakeup(worker_pipe[1]);
+                } else
+#endif
+                {
+                    printf("Server queue: %d queued, %lu shed.\n",
+                           server_queued, server_shed);
+                    lease_dump();
+                }
+                replication_dump();
+            }
             if(client_config) {
                 printf("Client in state %d, ", (int)state);
                 if(memcmp(selected_server, zeroes, 8) != 0)
@@ -470,6 +840,7 @@ main(int argc, char **argv)
             changed = 0;
             for(i = 0; i < numnetworks; i++)
                 check_network(&networks[i]);
+            update_network_table();
             set_timeout(CHECK_NETWORKS, 30000, 1);
             rc = reopen_logfile();
             if(rc < 0) {
@@ -478,43 +849,68 @@ main(int argc, char **argv)
             }
         }
 
-        if(FD_ISSET(protocol_socket, &readfds)) {
-            unsigned char buf[BUFFER_SIZE];
-            int len;
-            struct sockaddr *psin;
-            int sinlen;
-
-            len = ahcp_recv(protocol_socket, buf, BUFFER_SIZE,
-                           (struct sockaddr*)&sin6, sizeof(sin6));
-            if(len < 0) {
-                if(errno != EAGAIN && errno != EINTR) {
-                    perror("recv");
-                    sleep(5);
+        send_queued_packets();
+
+        if(replication_socket >= 0) {
+            if(event_ready(replication_socket))
+                replication_receive();
+            replication_send();
+        }
+
+        if(recv_next < recv_count ||
+           (replay_file ? replay_due() : ready_domain() >= 0)) {
+            unsigned char *buf;
+            int len, ll;
+            struct in6_addr dst;
+
+            if(recv_next >= recv_count && replay_file) {
+                rc = replay_batch();
+                if(rc <= 0)
+                    continue;
+            } else if(recv_next >= recv_count) {
+                recv_domain = ready_domain();
+                rc = ahcp_recv_batch(domains[recv_domain].socket);
+                if(rc <= 0) {
+                    if(rc < 0 && errno != EAGAIN && errno != EINTR) {
+                        perror("recv");
+                        sleep(5);
+                    }
+                    continue;
                 }
-                continue;
             }
 
-            psin = (struct sockaddr*)&sin6;
-            sinlen = sizeof(sin6);
+            buf = recv_buf[recv_next];
+            len = recv_len[recv_next];
+            memcpy(&sin6, &recv_sin[recv_next], sizeof(sin6));
+            memcpy(&dst, &recv_dst[recv_next], sizeof(dst));
+            net = find_network(recv_ifindex[recv_next]);
+            if(replay_file) {
+                replay_handling = 1;
+                replay_since = recv_time[recv_next];
+            }
+            recv_next++;
+
+            if(net >= 0) {
+                if(IN6_IS_ADDR_MULTICAST(&dst))
+                    networks[net].multicast_received++;
+                else
+                    networks[net].unicast_received++;
+            }
 
             if(IN6_IS_ADDR_LINKLOCAL(&sin6.sin6_addr)) {
-                for(net = 0; net < numnetworks; net++) {
-                    if(networks[net].ifindex <= 0)
-                        continue;
-                    if(networks[net].ifindex == sin6.sin6_scope_id)
-                        break;
-                }
-                if(net >= numnetworks) {
+                if(net < 0) {
                     fprintf(stderr, "Received packet on unknown network.\n");
                     continue;
                 }
+                ll = 1;
             } else {
-                net = -1;
+                ll = 0;
             }
 
-            rc = handle_packet(net >= 0, buf, len);
+            rc = handle_packet(recv_domain, net, ll,
+                               IN6_IS_ADDR_MULTICAST(&dst), &sin6, buf, len);
             gettime(&now, NULL);
-            if(rc == 2) {
+            if(rc == 2 && recv_domain == 0) {
                 unsigned char *body = buf + 24;
                 int bodylen = len - 24;
 
@@ -590,105 +986,36 @@ main(int argc, char **argv)
                 }
 
 #ifndef NO_SERVER
-                if(server_config) {
-                    if(body[0] == AHCP_DISCOVER ||
-                       body[0] == AHCP_REQUEST ||
-                       body[0] == AHCP_RELEASE) {
-                        struct config_data *config;
-                        unsigned client_lease_time;
-                        unsigned char reply[BUFFER_SIZE];
-                        int hopcount;
-                        unsigned char ipv4[4] = {0};
-
-                        config = parse_message(-1, body, bodylen, interfaces);
-                        if(!config) {
-                            fprintf(stderr, "Unparseable client message.\n");
-                            continue;
-                        }
-
-                        hopcount = buf[3];
-                        if(config->ipv4_address)
-                            prefix_list_extract4(ipv4, config->ipv4_address);
-                        client_lease_time =
-                            config->expires ?
-                            config->expires + roughly(120) :
-                            4 * 3600 + roughly(120);
-
-                        free_config_data(config);
-
-                        if(body[0] == AHCP_RELEASE) {
-                            if(memcmp(ipv4, zeroes, 4) != 0) {
-                                rc = release_lease(buf + 8, 8, ipv4);
-                                if(rc < 0) {
-                                    char a[INET_ADDRSTRLEN];
-                                    inet_ntop(AF_INET, ipv4, a,
-                                              INET_ADDRSTRLEN);
-                                    fprintf(stderr,
-                                            "Couldn't release lease for %s.\n",
-                                            a);
-                                }
-                            }
-                            continue;
-                        }
-
-                        if((config->ipv4_mandatory &&
-                            !server_config->lease_first[0]) ||
-                           (config->ipv6_mandatory &&
-                            !server_config->ipv6_prefix) ||
-                           config->ipv4_delegation_mandatory ||
-                           config->ipv6_delegation_mandatory) {
-                            /* We won't be able to satisfy the client's
-                               mandatory constraints. */
-                                rc = -1;
-                        } else if(server_config->lease_first[0] &&
-                                  config->ipv4_address) {
-                            rc = take_lease(buf + 8, 8,
-                                            memcmp(ipv4, zeroes, 4) == 0 ?
-                                            ipv4 : NULL,
-                                            ipv4, &client_lease_time,
-                                            body[0] == AHCP_REQUEST);
-                        } else {
-                            rc = 0;
-                        }
-
-                        /* If the client is in the initial state, there's
-                           no point in notifying it about failures -- it
-                           will time out and fall back to another server */
-                        if(rc < 0 && body[0] == AHCP_DISCOVER)
-                                continue;
-
-                        config =
-                            make_config_data(client_lease_time,
-                                             ipv4, server_config,
-                                             interfaces);
-                        if(config == NULL) {
-                            fprintf(stderr, "Couldn't build config data.\n");
-                            continue;
-                        }
-
-                        rc = server_body(rc < 0 ? AHCP_NACK :
-                                         body[0] == AHCP_DISCOVER ?
-                                         AHCP_OFFER : AHCP_ACK,
-                                         config, reply, BUFFER_SIZE);
-                        if(rc < 0) {
-                            fprintf(stderr, "Couldn't build reply.\n");
-                        } else {
-                            debugf(2, "Sending %d (%d bytes, %d hops).\n",
-                                   reply[0], rc, hopcount);
-                            usleep(roughly(50000));
-                            send_packet(psin, sinlen, buf + 8, hopcount,
-                                        reply, rc);
-                            gettime(&now, NULL);
-                        }
-                        
-                        free_config_data(config);
-
-                    }
+                /* Every shard gets multicast, but the kernel hands a
+                   unicast packet to a single one, which must serve it
+                   even if the reuseport group's order is off. */
+                if(server_config && replication_serving() &&
+                   (!IN6_IS_ADDR_MULTICAST(&dst) ||
+                    shard_of(buf + 8) == shard_index) &&
+                   (body[0] == AHCP_DISCOVER ||
+                    body[0] == AHCP_REQUEST ||
+                    body[0] == AHCP_RELEASE)) {
+                    rc = queue_server_message(buf, len, &sin6, net, ll);
+                    /* The server accounts for this one. */
+                    if(rc > 0)
+                        replay_handling = 0;
                 }
 #endif
             }
         }
 
+#ifndef NO_SERVER
+        if(lease_thread) {
+            if(worker_wakeup && recv_next >= recv_count) {
+                wakeup(worker_pipe[1]);
+                worker_wakeup = 0;
+            }
+            receive_replies();
+        } else if(server_queued > 0 && recv_next >= recv_count) {
+            run_server_queue();
+        }
+#endif
+
         if(config_data) {
             if(now.tv_sec >= config_data->expires_m) {
                 unconfigure(interfaces);
@@ -782,12 +1109,25 @@ main(int argc, char **argv)
            timeval_compare(&check_networks_time, &now) <= 0) {
             for(i = 0; i < numnetworks; i++)
                 check_network(&networks[i]);
+            update_network_table();
+            log_kernel_drops();
+            while(waitpid(-1, &status, WNOHANG) > 0)
+                ;
+            if(server_config && !lease_thread)
+                lease_check();
             set_timeout(CHECK_NETWORKS, 30000, 1);
         }
     }
 
     /* Clean up */
 
+    capture_close();
+
+#ifndef NO_SERVER
+    if(lease_thread)
+        stop_lease_thread();
+#endif
+
     if(config_data) {
         unsigned char buf[BUFFER_SIZE];
         int len;
@@ -827,11 +1167,12 @@ main(int argc, char **argv)
  usage:
     fprintf(stderr,
             "Syntax: ahcpd "
-            "[-m group] [-p port] [-n] [-4] [-6] [-N]\n"
+            "[-m group] [-p port] [-n] [-4] [-6] [-N] [-k count]\n"
             "              "
             "[-i file] [-s script] [-D] [-I pidfile] [-L logfile]\n"
             "              "
-            "[-C statement] [-c filename]"
+            "[-C statement] [-c filename] [-w file] [-r file] [-R file]\n"
+            "              "
             "interface...\n");
     exit(1);
 
@@ -841,143 +1182,962 @@ main(int argc, char **argv)
     exit(1);
 }
 
-unsigned
-roughly(unsigned value)
+#ifndef NO_SERVER
+
+/* Send a reply to a client, or pass it to the main thread if we are
+   running in the lease thread. */
+static int
+send_reply(struct sockaddr_in6 *sin6, const unsigned char *dest,
+           int hopcount, const unsigned char *reply, int len)
 {
-    return value * 3 / 4 + random() % (value / 4);
+    struct server_reply *r;
+
+    if(!lease_thread)
+        return send_packet_delayed((struct sockaddr*)sin6, sizeof(*sin6),
+                                   dest, hopcount, reply, len,
+                                   roughly(50000));
+
+    r = malloc(sizeof(struct server_reply));
+    if(r == NULL)
+        return -1;
+    r->data = malloc(len);
+    if(r->data == NULL) {
+        free(r);
+        return -1;
+    }
+    memcpy(&r->sin6, sin6, sizeof(r->sin6));
+    memcpy(r->dest, dest, 8);
+    r->hopcount = hopcount;
+    r->alarm = -1;
+    memcpy(r->data, reply, len);
+    r->len = len;
+    if(!ring_put(&from_worker, r)) {
+        free(r->data);
+        free(r);
+        return -1;
+    }
+    return 1;
 }
 
-static void
-set_timeout(int which, int msecs, int override)
+/* Called by the lease code when a pool crosses its high-water mark.  The
+   lease thread must not fork, so it passes the alarm to the main thread. */
+void
+high_water_alarm(int high, const char *name, const char *percent)
 {
-    struct timeval *tv;
-    int ms = msecs == 0 ? 0 : roughly(msecs);
-    switch(which) {
-    case MESSAGE: tv = &message_time; break;
-    case CHECK_NETWORKS: tv = &check_networks_time; break;
-    default: abort();
-    }
+    struct server_reply *r;
+    int n = strlen(name) + 1, p = strlen(percent) + 1;
 
-    /* (0, 0) represents never */
-    if(override || tv->tv_sec == 0 || tv->tv_sec > now.tv_sec + ms / 1000) {
-        if(msecs <= 0) {
-            tv->tv_usec = 0;
-            tv->tv_sec = 0;
-        } else {
-            tv->tv_usec =
-                (now.tv_usec + ms * 1000) % 1000000 + random() % 1000;
-            tv->tv_sec = now.tv_sec + (now.tv_usec / 1000 + ms) / 1000;
-        }
+    if(!lease_thread) {
+        run_high_water_script(high, name, percent);
+        return;
     }
+
+    r = calloc(1, sizeof(struct server_reply));
+    if(r == NULL)
+        goto fail;
+    r->data = malloc(n + p);
+    if(r->data == NULL)
+        goto fail;
+    memcpy(r->data, name, n);
+    memcpy(r->data + n, percent, p);
+    r->len = n + p;
+    r->alarm = high;
+    if(!ring_put(&from_worker, r))
+        goto fail;
+    return;
+
+ fail:
+    fprintf(stderr, "Couldn't queue high-water alarm.\n");
+    if(r)
+        free(r->data);
+    free(r);
 }
 
-static int
-check_network(struct network *net)
+/* Handle a client message.  Sin6 is the neighbour it came from, net the
+   ingress network, ifindex its interface index, and ll whether the
+   neighbour is link-local. */
+static void
+server_message(const unsigned char *buf, int len,
+               struct sockaddr_in6 *sin6, int net, int ll, int ifindex)
 {
-    int ifindex, rc;
-    struct ipv6_mreq mreq;
+    struct config_data *config;
+    struct server_config *sc;
+    unsigned client_lease_time;
+    unsigned char reply[BUFFER_SIZE];
+    int hopcount, commit;
+    unsigned char ipv4[4] = {0}, ipv6[16];
+    int have_ipv6 = 0;
+    struct prefix delegation[2];
+    int have_delegation[2] = {0, 0};
+    const unsigned char *body = buf + 24;
+    int bodylen = len - 24;
+    int rc;
 
-    ifindex = if_nametoindex(net->ifname);
-    if(ifindex != net->ifindex) {
-        net->ifindex = ifindex;
-        if(net->ifindex > 0) {
-            memset(&mreq, 0, sizeof(mreq));
-            memcpy(&mreq.ipv6mr_multiaddr, &protocol_group, 16);
-            mreq.ipv6mr_interface = net->ifindex;
-            rc = setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_JOIN_GROUP,
-                            (char*)&mreq, sizeof(mreq));
+    config = parse_message(-1, body, bodylen, interfaces);
+    if(!config) {
+        fprintf(stderr, "Unparseable client message.\n");
+        return;
+    }
+
+    hopcount = buf[3];
+    /* A client that is a direct neighbour gets a unicast reply on the
+       ingress interface that nobody will forward. */
+    if(ll && buf[2] == buf[3]) {
+        hopcount = 1;
+        sin6->sin6_scope_id = ifindex;
+    }
+    commit = body[0] == AHCP_REQUEST;
+    if(config->ipv4_address)
+        prefix_list_extract4(ipv4, config->ipv4_address);
+    sc = find_server_config(ll ? net : -1, ipv4);
+    client_lease_time =
+        config->expires ?
+        config->expires + roughly(120) : 4 * 3600 + roughly(120);
+
+    if(body[0] == AHCP_RELEASE) {
+        free_config_data(config);
+        if(memcmp(ipv4, zeroes, 4) != 0) {
+            rc = release_lease(buf + 8, 8, ipv4);
             if(rc < 0) {
-                perror("setsockopt(IPV6_JOIN_GROUP)");
-                net->ifindex = 0;
-                goto fail;
+                char a[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, ipv4, a, INET_ADDRSTRLEN);
+                fprintf(stderr, "Couldn't release lease for %s.\n", a);
             }
-            return 1;
         }
+        if(sc->address_prefix || sc->ipv6_delegation || sc->ipv4_delegation) {
+            rc = release_client_leases(buf + 8, 8);
+            if(rc < 0)
+                fprintf(stderr, "Couldn't release leases.\n");
+        }
+        return;
     }
- fail:
-    return 0;
-}
 
-static void
-sigexit(int signo)
-{
-    exiting = 1;
-}
+    if((config->ipv4_mandatory && !sc->lease_first[0]) ||
+       (config->ipv6_mandatory && !sc->ipv6_prefix) ||
+       (config->ipv4_delegation_mandatory && !sc->ipv4_delegation) ||
+       (config->ipv6_delegation_mandatory && !sc->ipv6_delegation)) {
+        /* We won't be able to satisfy the client's mandatory
+           constraints. */
+        rc = -1;
+    } else if(sc->lease_first[0] && config->ipv4_address) {
+        rc = take_lease(buf + 8, 8, sc->lease_first, sc->lease_last,
+                        memcmp(ipv4, zeroes, 4) == 0 ? ipv4 : NULL,
+                        ipv4, &client_lease_time, commit);
+    } else {
+        rc = 0;
+    }
 
-static void
-sigdump(int signo)
-{
-    dumping = 1;
+    /* A stateful IPv6 address is optional, the client can always fall
+       back to autoconfiguration. */
+    if(rc >= 0 && config->ipv6_prefix && sc->ipv6_prefix &&
+       sc->address_prefix) {
+        have_ipv6 =
+            take_ipv6_lease(buf + 8, 8, &sc->address_prefix->l[0],
+                            ipv6, &client_lease_time, commit) >= 0;
+    }
+
+    if(rc >= 0 && config->ipv6_prefix_delegation &&
+       sc->ipv6_delegation) {
+        rc = take_delegation(buf + 8, 8, &sc->ipv6_delegation->l[0],
+                             &delegation[0], &client_lease_time, commit);
+        have_delegation[0] = rc >= 0;
+        if(!config->ipv6_delegation_mandatory)
+            rc = 0;
+    }
+
+    if(rc >= 0 && config->ipv4_prefix_delegation &&
+       sc->ipv4_delegation) {
+        rc = take_delegation(buf + 8, 8, &sc->ipv4_delegation->l[0],
+                             &delegation[1], &client_lease_time, commit);
+        have_delegation[1] = rc >= 0;
+        if(!config->ipv4_delegation_mandatory)
+            rc = 0;
+    }
+
+    free_config_data(config);
+
+    /* If the client is in the initial state, there's no point in
+       notifying it about failures -- it will time out and fall back to
+       another server */
+    if(rc < 0 && body[0] == AHCP_DISCOVER)
+        return;
+
+    config = make_config_data(client_lease_time, ipv4,
+                              have_ipv6 ? ipv6 : NULL,
+                              have_delegation[0] ? &delegation[0] : NULL,
+                              have_delegation[1] ? &delegation[1] : NULL,
+                              sc, interfaces);
+    if(config == NULL) {
+        fprintf(stderr, "Couldn't build config data.\n");
+        return;
+    }
+
+    rc = server_body(rc < 0 ? AHCP_NACK :
+                     body[0] == AHCP_DISCOVER ? AHCP_OFFER : AHCP_ACK,
+                     config, reply, BUFFER_SIZE);
+    if(rc < 0) {
+        fprintf(stderr, "Couldn't build reply.\n");
+    } else {
+        debugf(2, "Sending %d (%d bytes, %d hops).\n",
+               reply[0], rc, hopcount);
+        rc = send_reply(sin6, buf + 8, hopcount, reply, rc);
+        if(rc < 0)
+            fprintf(stderr, "Couldn't queue reply.\n");
+    }
+
+    free_config_data(config);
 }
 
+/* Free a message that the server is done with, either because it was
+   handled or because it was shed. */
 static void
-sigchanged(int signo)
+finish_message(struct server_message *m, int handled)
 {
-    changed = 1;
+    if(handled && replay_file)
+        replay_account(&m->received);
+    free(m->buf);
+    free(m);
+    __atomic_add_fetch(&messages_done, 1, __ATOMIC_RELEASE);
 }
 
+/* Classify a client message and queue it.  When the queue is full, the
+   oldest discovery is shed to make room for anything else. */
 static void
-init_signals(void)
+enqueue_message(struct server_message *m)
 {
-    struct sigaction sa;
-    sigset_t ss;
-
-    sigemptyset(&ss);
-    sa.sa_handler = sigexit;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGTERM, &sa, NULL);
-
-    sigemptyset(&ss);
-    sa.sa_handler = sigexit;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGHUP, &sa, NULL);
-
-    sigemptyset(&ss);
-    sa.sa_handler = sigexit;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGINT, &sa, NULL);
-
-    sigemptyset(&ss);
-    sa.sa_handler = sigdump;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGUSR1, &sa, NULL);
-
-    sigemptyset(&ss);
-    sa.sa_handler = sigchanged;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGUSR2, &sa, NULL);
+    struct server_message *old;
+    int class;
 
-#ifdef SIGINFO
-    sigemptyset(&ss);
-    sa.sa_handler = sigdump;
-    sa.sa_mask = ss;
-    sa.sa_flags = 0;
-    sigaction(SIGINFO, &sa, NULL);
-#endif
+    if(m->buf[24] == AHCP_DISCOVER)
+        class = CLASS_DISCOVER;
+    else if(m->buf[24] == AHCP_RELEASE || client_bound(m->buf + 8, 8))
+        class = CLASS_KNOWN;
+    else
+        class = CLASS_REQUEST;
+
+    if(server_queued >= SERVER_QUEUE_MAX) {
+        if(class == CLASS_DISCOVER || !server_queue[CLASS_DISCOVER]) {
+            finish_message(m, 0);
+            server_shed++;
+            return;
+        }
+        old = server_queue[CLASS_DISCOVER];
+        server_queue[CLASS_DISCOVER] = old->next;
+        finish_message(old, 0);
+        server_queued--;
+        server_shed++;
+    }
+
+    if(server_queue[class])
+        server_queue_tail[class]->next = m;
+    else
+        server_queue[class] = m;
+    server_queue_tail[class] = m;
+    server_queued++;
 }
 
-int
-ahcp_socket(int port)
+/* Copy a client message and queue it, either directly or through the
+   lease thread.  Returns 1 if the message was queued. */
+static int
+queue_server_message(const unsigned char *buf, int len,
+                     const struct sockaddr_in6 *sin6, int net, int ll)
 {
-    struct sockaddr_in6 sin6;
-    int s, rc;
-    int saved_errno;
-    int one = 1, zero = 0;
-    const int ds = 0xc0;        /* CS6 - Network Control */
+    struct server_message *m;
 
-    s = socket(PF_INET6, SOCK_DGRAM, 0);
-    if(s < 0)
-        return -1;
+    if(!rate_check(RATE_REPLY, buf + 8)) {
+        debugf(2, "Client over its rate, ignoring.\n");
+        return 0;
+    }
 
-    rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-    if(rc < 0)
+    m = malloc(sizeof(struct server_message));
+    if(m == NULL) {
+        perror("malloc(server_message)");
+        return -1;
+    }
+    m->buf = malloc(len);
+    if(m->buf == NULL) {
+        perror("malloc(server_message)");
+        free(m);
+        return -1;
+    }
+    memcpy(m->buf, buf, len);
+    m->len = len;
+    memcpy(&m->sin6, sin6, sizeof(m->sin6));
+    m->net = net;
+    m->ll = ll;
+    m->ifindex = ll ? networks[net].ifindex : 0;
+    m->received = replay_since;
+    m->next = NULL;
+
+    if(!lease_thread) {
+        messages_queued++;
+        enqueue_message(m);
+        return 1;
+    }
+
+    if(!ring_put(&to_worker, m)) {
+        free(m->buf);
+        free(m);
+        worker_dropped++;
+        return 0;
+    }
+    messages_queued++;
+    worker_wakeup = 1;
+    return 1;
+}
+
+/* How many replies we can produce without dropping any. */
+static int
+reply_space(void)
+{
+    return lease_thread ? ring_space(&from_worker) : send_queue_space();
+}
+
+/* Handle up to SERVER_BUDGET queued messages, highest class first.  Stop
+   when there is no room left for the replies. */
+static void
+run_server_queue(void)
+{
+    struct server_message *m;
+    int class, n = 0;
+
+    while(server_queued > 0 && n < SERVER_BUDGET && reply_space() > 0) {
+        for(class = 0; class < NUM_CLASSES; class++) {
+            if(server_queue[class])
+                break;
+        }
+        m = server_queue[class];
+        server_queue[class] = m->next;
+        server_queued--;
+        n++;
+
+        if(replication_serving())
+            server_message(m->buf, m->len, &m->sin6, m->net, m->ll,
+                           m->ifindex);
+        finish_message(m, 1);
+    }
+}
+
+static void
+wakeup(int fd)
+{
+    int rc;
+    rc = write(fd, "", 1);
+    if(rc < 0 && errno != EAGAIN)
+        perror("write(wakeup)");
+}
+
+static void
+drain(int fd)
+{
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void *
+lease_thread_main(void *arg)
+{
+    struct server_message *m;
+    struct pollfd pfd;
+    struct timeval tv;
+    time_t check_time;
+    int timeout;
+
+    gettime(&tv, NULL);
+    check_time = tv.tv_sec + 30;
+
+    while(!__atomic_load_n(&worker_stop, __ATOMIC_ACQUIRE)) {
+        while((m = ring_get(&to_worker)) != NULL)
+            enqueue_message(m);
+
+        if(__atomic_exchange_n(&worker_dump, 0, __ATOMIC_ACQ_REL)) {
+            printf("Server queue: %d queued, %lu shed.\n",
+                   server_queued, server_shed);
+            lease_dump();
+            fflush(stdout);
+        }
+
+        gettime(&tv, NULL);
+        if(tv.tv_sec >= check_time) {
+            lease_check();
+            check_time = tv.tv_sec + 30;
+        }
+
+        if(server_queued > 0 && reply_space() > 0) {
+            run_server_queue();
+            wakeup(reply_pipe[1]);
+            continue;
+        }
+
+        /* If the main thread isn't picking up our replies, poll. */
+        if(server_queued > 0)
+            timeout = 10;
+        else
+            timeout = (check_time - tv.tv_sec) * 1000;
+
+        pfd.fd = worker_pipe[0];
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, timeout) > 0)
+            drain(worker_pipe[0]);
+    }
+    return NULL;
+}
+
+static int
+nonblocking_pipe(int *fds)
+{
+    int rc;
+
+    rc = pipe(fds);
+    if(rc < 0)
+        return -1;
+
+    rc = fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    if(rc >= 0)
+        rc = fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    if(rc >= 0)
+        rc = fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    if(rc >= 0)
+        rc = fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    if(rc < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 1;
+}
+
+/* Start the lease thread.  It runs with all signals blocked, so that
+   they are delivered to the main thread. */
+static int
+start_lease_thread(void)
+{
+    sigset_t all, old;
+    int rc;
+
+    rc = nonblocking_pipe(worker_pipe);
+    if(rc < 0)
+        return -1;
+    rc = nonblocking_pipe(reply_pipe);
+    if(rc < 0)
+        return -1;
+    rc = event_add(reply_pipe[0]);
+    if(rc < 0)
+        return -1;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rc = pthread_create(&worker, NULL, lease_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    lease_thread = 1;
+    return 1;
+}
+
+static void
+stop_lease_thread(void)
+{
+    __atomic_store_n(&worker_stop, 1, __ATOMIC_RELEASE);
+    wakeup(worker_pipe[1]);
+    pthread_join(worker, NULL);
+    lease_thread = 0;
+}
+
+/* Pick up the lease thread's replies, as long as there is room in the
+   send queue. */
+static void
+receive_replies(void)
+{
+    struct server_reply *r;
+    int rc;
+
+    if(event_ready(reply_pipe[0]))
+        drain(reply_pipe[0]);
+
+    while(send_queue_space() > 0 &&
+          (r = ring_get(&from_worker)) != NULL) {
+        if(r->alarm >= 0) {
+            run_high_water_script(r->alarm, (char*)r->data,
+                                  (char*)r->data + strlen((char*)r->data) + 1);
+            free(r->data);
+            free(r);
+            continue;
+        }
+        rc = send_packet_delayed((struct sockaddr*)&r->sin6,
+                                 sizeof(r->sin6), r->dest, r->hopcount,
+                                 r->data, r->len, roughly(50000));
+        if(rc < 0)
+            fprintf(stderr, "Couldn't queue reply.\n");
+        free(r->data);
+        free(r);
+    }
+}
+#endif
+
+#ifndef NO_SERVER
+
+/* Register the address pools of a server configuration.  Returns 1 if
+   the configuration needs the lease database. */
+static int
+init_pools(struct server_config *sc)
+{
+    int rc;
+
+    if(sc->lease_first[0] != 0) {
+        rc = address_pool_init(sc->lease_first, sc->lease_last,
+                               sc->high_water);
+        if(rc < 0)
+            return -1;
+    }
+
+    if(sc->address_prefix) {
+        rc = ipv6_pool_init(&sc->address_prefix->l[0], sc->high_water);
+        if(rc < 0)
+            return -1;
+    }
+
+    if(sc->ipv6_delegation) {
+        rc = delegation_init(&sc->ipv6_delegation->l[0],
+                             sc->ipv6_delegation_plen, sc->high_water);
+        if(rc < 0)
+            return -1;
+    }
+
+    if(sc->ipv4_delegation) {
+        rc = delegation_init(&sc->ipv4_delegation->l[0],
+                             sc->ipv4_delegation_plen, sc->high_water);
+        if(rc < 0)
+            return -1;
+    }
+
+    return sc->lease_first[0] != 0 || sc->address_prefix ||
+        sc->ipv6_delegation || sc->ipv4_delegation;
+}
+
+/* Find the server configuration that applies to a client message.  If we
+   don't know the ingress network, which happens with unicast renewals,
+   use the configuration whose range contains the client's address. */
+static struct server_config *
+find_server_config(int net, const unsigned char *ipv4)
+{
+    struct interface_config *iface;
+
+    if(net >= 0)
+        return networks[net].server_config;
+
+    if(memcmp(ipv4, zeroes, 4) != 0) {
+        for(iface = interface_configs; iface; iface = iface->next) {
+            struct server_config *sc = iface->server_config;
+            if(sc && sc->lease_first[0] != 0 &&
+               memcmp(ipv4, sc->lease_first, 4) >= 0 &&
+               memcmp(ipv4, sc->lease_last, 4) <= 0)
+                return sc;
+        }
+    }
+    return server_config;
+}
+
+#endif
+
+unsigned
+roughly(unsigned value)
+{
+    return value * 3 / 4 + random() % (value / 4);
+}
+
+static void
+set_timeout(int which, int msecs, int override)
+{
+    struct timeval *tv;
+    int ms = msecs == 0 ? 0 : roughly(msecs);
+    switch(which) {
+    case MESSAGE: tv = &message_time; break;
+    case CHECK_NETWORKS: tv = &check_networks_time; break;
+    default: abort();
+    }
+
+    /* (0, 0) represents never */
+    if(override || tv->tv_sec == 0 || tv->tv_sec > now.tv_sec + ms / 1000) {
+        if(msecs <= 0) {
+            tv->tv_usec = 0;
+            tv->tv_sec = 0;
+        } else {
+            tv->tv_usec =
+                (now.tv_usec + ms * 1000) % 1000000 + random() % 1000;
+            tv->tv_sec = now.tv_sec + (now.tv_usec / 1000 + ms) / 1000;
+        }
+    }
+}
+
+static int
+check_network(struct network *net)
+{
+    int ifindex, rc, i;
+    struct ipv6_mreq mreq;
+
+    ifindex = if_nametoindex(net->ifname);
+    if(ifindex != net->ifindex) {
+        net->ifindex = ifindex;
+        if(net->ifindex > 0) {
+            for(i = 0; i < numdomains; i++) {
+                if(domains[i].socket < 0)
+                    continue;
+                memset(&mreq, 0, sizeof(mreq));
+                memcpy(&mreq.ipv6mr_multiaddr, &domains[i].group, 16);
+                mreq.ipv6mr_interface = net->ifindex;
+                rc = setsockopt(domains[i].socket, IPPROTO_IPV6,
+                                IPV6_JOIN_GROUP,
+                                (char*)&mreq, sizeof(mreq));
+                /* Already joined by an earlier, partly failed attempt. */
+                if(rc < 0 && errno != EADDRINUSE) {
+                    perror("setsockopt(IPV6_JOIN_GROUP)");
+                    net->ifindex = 0;
+                    goto fail;
+                }
+            }
+            for(i = 0; i < numdomains; i++) {
+                struct sockaddr_in6 *group = &net->group[i];
+                memset(group, 0, sizeof(*group));
+                group->sin6_family = AF_INET6;
+                memcpy(&group->sin6_addr, &domains[i].group, 16);
+                group->sin6_port = htons(domains[i].port);
+                group->sin6_scope_id = net->ifindex;
+            }
+            return 1;
+        }
+    }
+ fail:
+    return 0;
+}
+
+static void
+capture_batch(int n)
+{
+    struct capture_record rec;
+    int i;
+
+    gettime(&rec.time, NULL);
+    for(i = 0; i < n; i++) {
+        rec.ifindex = recv_ifindex[i];
+        rec.domain = recv_domain;
+        memcpy(&rec.from, &recv_sin[i], sizeof(rec.from));
+        memcpy(&rec.dst, &recv_dst[i], sizeof(rec.dst));
+        rec.len = recv_len[i];
+        capture_write(&rec, recv_buf[i]);
+    }
+}
+
+/* When the next packet of the capture should be replayed. */
+static void
+replay_due_time(struct timeval *due)
+{
+    struct timeval d;
+
+    timeval_minus(&d, &replay_rec.time, &replay_first);
+    due->tv_sec = replay_start.tv_sec + d.tv_sec;
+    due->tv_usec = replay_start.tv_usec + d.tv_usec;
+    if(due->tv_usec >= 1000000) {
+        due->tv_sec++;
+        due->tv_usec -= 1000000;
+    }
+}
+
+static int
+replay_due(void)
+{
+    struct timeval due;
+
+    if(!replay_pending)
+        return 0;
+    if(replay_fast)
+        return 1;
+    replay_due_time(&due);
+    return timeval_compare(&due, &now) <= 0;
+}
+
+/* Fill the receive ring from the capture, with the packets of a single
+   domain that are due. */
+static int
+replay_batch(void)
+{
+    recv_count = recv_next = 0;
+
+    while(recv_count < RECV_BATCH && replay_due()) {
+        int domain = replay_rec.domain < numdomains ? replay_rec.domain : 0;
+        if(recv_count > 0 && domain != recv_domain)
+            break;
+        recv_domain = domain;
+        memcpy(recv_buf[recv_count], replay_buf, replay_rec.len);
+        recv_len[recv_count] = replay_rec.len;
+        memcpy(&recv_sin[recv_count], &replay_rec.from, sizeof(recv_sin[0]));
+        memcpy(&recv_dst[recv_count], &replay_rec.dst, sizeof(recv_dst[0]));
+        recv_ifindex[recv_count] = replay_rec.ifindex;
+        gettime(&recv_time[recv_count], NULL);
+        recv_count++;
+        replay_count++;
+        replay_pending =
+            replay_read(&replay_rec, replay_buf, BUFFER_SIZE) > 0;
+    }
+    return recv_count;
+}
+
+/* Record the latency of a packet read at since.  This is called by the
+   lease thread too. */
+static void
+replay_account(const struct timeval *since)
+{
+    struct timeval tv, d;
+    long long us;
+
+    gettime(&tv, NULL);
+    timeval_minus(&d, &tv, since);
+    us = (long long)d.tv_sec * 1000000 + d.tv_usec;
+    pthread_mutex_lock(&replay_mutex);
+    replay_latency += us;
+    if(us > replay_max)
+        replay_max = us;
+    replay_samples++;
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+/* Whether the server is done with every packet we gave it, and its
+   replies have been picked up. */
+static int
+replay_idle(void)
+{
+#ifndef NO_SERVER
+    if(__atomic_load_n(&messages_done, __ATOMIC_ACQUIRE) != messages_queued)
+        return 0;
+    if(lease_thread && ring_count(&from_worker) > 0)
+        return 0;
+#endif
+    return 1;
+}
+
+static void
+replay_report(void)
+{
+    struct timeval tv, d;
+    double secs;
+
+    gettime(&tv, NULL);
+    timeval_minus(&d, &tv, &replay_start);
+    secs = d.tv_sec + d.tv_usec / 1000000.0;
+    pthread_mutex_lock(&replay_mutex);
+    printf("Replayed %lu packets in %.3fs (%.0f packets/s), "
+           "latency %lldus average, %lldus maximum over %lu handled.\n",
+           replay_count, secs, secs > 0 ? replay_count / secs : 0.0,
+           replay_samples > 0 ?
+           replay_latency / (long long)replay_samples : 0,
+           replay_max, replay_samples);
+    pthread_mutex_unlock(&replay_mutex);
+    fflush(stdout);
+}
+
+/* A domain whose socket is readable, or -1.  Start after the last one
+   we read from, so that a busy domain doesn't starve the others. */
+static int
+ready_domain(void)
+{
+    int i, d;
+
+    for(i = 1; i <= numdomains; i++) {
+        d = (recv_domain + i) % numdomains;
+        if(event_ready(domains[d].socket))
+            return d;
+    }
+    return -1;
+}
+
+static void
+update_network_table(void)
+{
+    int i;
+
+    for(i = 0; i < MAX_IFINDEX; i++)
+        network_table[i] = -1;
+
+    for(i = 0; i < numnetworks; i++) {
+        if(networks[i].ifindex > 0 && networks[i].ifindex < MAX_IFINDEX)
+            network_table[networks[i].ifindex] = i;
+    }
+}
+
+static int
+find_network(int ifindex)
+{
+    int i;
+
+    if(ifindex <= 0)
+        return -1;
+
+    if(ifindex < MAX_IFINDEX)
+        return network_table[ifindex];
+
+    for(i = 0; i < numnetworks; i++) {
+        if(networks[i].ifindex == ifindex)
+            return i;
+    }
+    return -1;
+}
+
+static void
+sigexit(int signo)
+{
+    exiting = 1;
+}
+
+static void
+sigdump(int signo)
+{
+    dumping = 1;
+}
+
+static void
+sigchanged(int signo)
+{
+    changed = 1;
+}
+
+static int
+init_signals(void)
+{
+    int rc;
+
+    rc = event_signal(SIGTERM, sigexit);
+    if(rc >= 0)
+        rc = event_signal(SIGHUP, sigexit);
+    if(rc >= 0)
+        rc = event_signal(SIGINT, sigexit);
+    if(rc >= 0)
+        rc = event_signal(SIGUSR1, sigdump);
+    if(rc >= 0)
+        rc = event_signal(SIGUSR2, sigchanged);
+#ifdef SIGINFO
+    if(rc >= 0)
+        rc = event_signal(SIGINFO, sigdump);
+#endif
+    return rc;
+}
+
+/* Drop obviously bogus packets and our own in the kernel.  Handle_packet
+   performs the same checks, so this is only an optimisation.  The filter
+   sees the UDP header, hence the offset of 8. */
+
+static int
+attach_filter(int s)
+{
+#ifdef SO_ATTACH_FILTER
+    unsigned id0 = ((unsigned)myid[0] << 24) | (myid[1] << 16) |
+        (myid[2] << 8) | myid[3];
+    unsigned id1 = ((unsigned)myid[4] << 24) | (myid[5] << 16) |
+        (myid[6] << 8) | myid[7];
+    struct sock_filter code[] = {
+        /* 0 */ BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        /* 1 */ BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + 24, 0, 14),
+        /* 2 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 0),
+        /* 3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 43, 0, 12),
+        /* 4 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 1),
+        /* 5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 10),
+        /* hop count must be non-zero and at most the original */
+        /* 6 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 3),
+        /* 7 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        /* 8 */ BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 2),
+        /* 9 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 0),
+        /* 10 */ BPF_JUMP(BPF_JMP | BPF_JGT | BPF_X, 0, 5, 0),
+        /* source must not be us */
+        /* 11 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8 + 8),
+        /* 12 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id0, 0, 2),
+        /* 13 */ BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8 + 12),
+        /* 14 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id1, 1, 0),
+        /* 15 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        /* 16 */ BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    return setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+#else
+    return 0;
+#endif
+}
+
+/* Steer datagrams to the process in the reuseport group whose index is
+   the shard of their source id.  The kernel strips the UDP header. */
+
+static int
+attach_reuseport_filter(int s)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shard_count),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    return setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                      &prog, sizeof(prog));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifndef NO_SERVER
+
+/* Must match the filter above. */
+
+static int
+shard_of(const unsigned char *id)
+{
+    unsigned h0 = ((unsigned)id[0] << 24) | (id[1] << 16) |
+        (id[2] << 8) | id[3];
+    unsigned h1 = ((unsigned)id[4] << 24) | (id[5] << 16) |
+        (id[6] << 8) | id[7];
+
+    if(shard_count <= 1)
+        return 0;
+    return (h0 ^ h1) % shard_count;
+}
+
+#endif
+
+int
+ahcp_socket(int port)
+{
+    struct sockaddr_in6 sin6;
+    int s, rc;
+    int saved_errno;
+    int one = 1, zero = 0;
+    const int ds = 0xc0;        /* CS6 - Network Control */
+
+    s = socket(PF_INET6, SOCK_DGRAM, 0);
+    if(s < 0)
+        return -1;
+
+    rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(rc < 0)
         perror("setsockopt(SO_REUSEADDR)");
 
+    if(shard_count > 1) {
+#ifdef SO_REUSEPORT
+        rc = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#else
+        rc = -1;
+        errno = ENOSYS;
+#endif
+        if(rc < 0)
+            goto fail;
+    }
+
     rc = setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
                     &zero, sizeof(zero));
     if(rc < 0)
@@ -988,6 +2148,45 @@ ahcp_socket(int port)
     if(rc < 0)
         perror("setsockopt(IPV6_MULTICAST_HOPS)");
 
+#ifdef IPV6_RECVPKTINFO
+    rc = setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+    if(rc < 0)
+        perror("setsockopt(IPV6_RECVPKTINFO)");
+#endif
+
+#ifdef SO_RXQ_OVFL
+    rc = setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    if(rc < 0)
+        perror("setsockopt(SO_RXQ_OVFL)");
+#endif
+
+    if(receive_buffer > 0) {
+        rc = -1;
+#ifdef SO_RCVBUFFORCE
+        /* Not limited by rmem_max, but needs CAP_NET_ADMIN. */
+        rc = setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE,
+                        &receive_buffer, sizeof(receive_buffer));
+#endif
+        if(rc < 0)
+            rc = setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+                            &receive_buffer, sizeof(receive_buffer));
+        if(rc < 0)
+            perror("setsockopt(SO_RCVBUF)");
+    }
+
+    if(send_buffer > 0) {
+        rc = -1;
+#ifdef SO_SNDBUFFORCE
+        rc = setsockopt(s, SOL_SOCKET, SO_SNDBUFFORCE,
+                        &send_buffer, sizeof(send_buffer));
+#endif
+        if(rc < 0)
+            rc = setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+                            &send_buffer, sizeof(send_buffer));
+        if(rc < 0)
+            perror("setsockopt(SO_SNDBUF)");
+    }
+
 #ifdef IPV6_V6ONLY
     rc = setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
                     &zero, sizeof(zero));
@@ -1020,6 +2219,10 @@ ahcp_socket(int port)
     if(rc < 0)
         goto fail;
 
+    rc = attach_filter(s);
+    if(rc < 0)
+        perror("attach_filter");
+
     memset(&sin6, 0, sizeof(sin6));
     sin6.sin6_family = AF_INET6;
     sin6.sin6_port = htons(port);
@@ -1027,6 +2230,12 @@ ahcp_socket(int port)
     if(rc < 0)
         goto fail;
 
+    if(shard_count > 1) {
+        rc = attach_reuseport_filter(s);
+        if(rc < 0)
+            perror("attach_reuseport_filter");
+    }
+
     return s;
 
  fail:
@@ -1036,22 +2245,121 @@ ahcp_socket(int port)
     return -1;
 }
 
-int
-ahcp_recv(int s, void *buf, int buflen, struct sockaddr *sin, int slen)
+/* Extract the ingress interface and destination of the ith datagram in
+   the ring.  Without IPV6_PKTINFO, fall back to the scope of the source. */
+
+static void
+recv_pktinfo(struct msghdr *msg, int i)
 {
-    struct iovec iovec;
+    struct cmsghdr *cmsg;
+
+    recv_ifindex[i] = recv_sin[i].sin6_scope_id;
+    memset(&recv_dst[i], 0, sizeof(recv_dst[i]));
+
+    for(cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level == IPPROTO_IPV6 &&
+           cmsg->cmsg_type == IPV6_PKTINFO) {
+            struct in6_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+            recv_ifindex[i] = info.ipi6_ifindex;
+            memcpy(&recv_dst[i], &info.ipi6_addr, sizeof(recv_dst[i]));
+#ifdef SO_RXQ_OVFL
+        } else if(cmsg->cmsg_level == SOL_SOCKET &&
+                  cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&domains[recv_domain].kernel_dropped, CMSG_DATA(cmsg),
+                   sizeof(unsigned int));
+#endif
+        }
+    }
+}
+
+/* Log how many packets the kernel dropped since the last call.  The
+   count includes those rejected by our socket filter, such as our own
+   floods echoed back by neighbours, so it's not only buffer overflows. */
+
+static void
+log_kernel_drops(void)
+{
+    int i;
+
+    for(i = 0; i < numdomains; i++) {
+        struct domain *domain = &domains[i];
+        if(domain->kernel_dropped != domain->kernel_logged) {
+            debugf(2, "Kernel dropped %u packets on port %u, "
+                   "including filtered ones.\n",
+                   domain->kernel_dropped - domain->kernel_logged,
+                   domain->port);
+            domain->kernel_logged = domain->kernel_dropped;
+        }
+    }
+}
+
+/* Fill the receive ring with as many datagrams as are available, up to
+   RECV_BATCH.  Returns the number of datagrams read, or -1. */
+
+static int
+ahcp_recv_batch(int s)
+{
+    struct iovec iovec[RECV_BATCH];
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[RECV_BATCH];
+#else
     struct msghdr msg;
-    int rc;
+#endif
+    int i, rc;
+
+    recv_count = recv_next = 0;
+
+#ifdef HAVE_RECVMMSG
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < RECV_BATCH; i++) {
+        iovec[i].iov_base = recv_buf[i];
+        iovec[i].iov_len = BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_name = &recv_sin[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(recv_sin[i]);
+        msgs[i].msg_hdr.msg_iov = &iovec[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = recv_cmsg[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(recv_cmsg[i]);
+    }
 
-    memset(&msg, 0, sizeof(msg));
-    iovec.iov_base = buf;
-    iovec.iov_len = buflen;
-    msg.msg_name = sin;
-    msg.msg_namelen = slen;
-    msg.msg_iov = &iovec;
-    msg.msg_iovlen = 1;
+    rc = recvmmsg(s, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+    if(rc < 0)
+        return -1;
 
-    rc = recvmsg(s, &msg, 0);
+    for(i = 0; i < rc; i++) {
+        recv_len[i] = msgs[i].msg_len;
+        recv_pktinfo(&msgs[i].msg_hdr, i);
+    }
+    if(capture_file)
+        capture_batch(rc);
+#else
+    for(i = 0; i < RECV_BATCH; i++) {
+        memset(&msg, 0, sizeof(msg));
+        iovec[i].iov_base = recv_buf[i];
+        iovec[i].iov_len = BUFFER_SIZE;
+        msg.msg_name = &recv_sin[i];
+        msg.msg_namelen = sizeof(recv_sin[i]);
+        msg.msg_iov = &iovec[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = recv_cmsg[i];
+        msg.msg_controllen = sizeof(recv_cmsg[i]);
+
+        rc = recvmsg(s, &msg, 0);
+        if(rc < 0) {
+            if(i > 0 && (errno == EAGAIN || errno == EINTR))
+                break;
+            return -1;
+        }
+        recv_len[i] = rc;
+        recv_pktinfo(&msg, i);
+    }
+    rc = i;
+    if(capture_file)
+        capture_batch(rc);
+#endif
+
+    recv_count = rc;
     return rc;
 }
 
@@ -1128,6 +2436,42 @@ timeval_minus(struct timeval *d,
     }
 }
 
+int
+timeval_minus_msec(const struct timeval *s1, const struct timeval *s2)
+{
+    if(s1->tv_sec < s2->tv_sec)
+        return 0;
+
+    /* Avoid overflow. */
+    if(s1->tv_sec - s2->tv_sec > 2000000)
+        return 2000000000;
+
+    if(s1->tv_sec > s2->tv_sec)
+        return
+            (int)((unsigned)(s1->tv_sec - s2->tv_sec) * 1000 +
+                  ((int)s1->tv_usec - s2->tv_usec) / 1000);
+
+    if(s1->tv_usec <= s2->tv_usec)
+        return 0;
+
+    return (unsigned)(s1->tv_usec - s2->tv_usec) / 1000u;
+}
+
+void
+timeval_plus_msec(struct timeval *d, const struct timeval *s, int msecs)
+{
+    int usecs;
+
+    d->tv_sec = s->tv_sec + msecs / 1000;
+    usecs = s->tv_usec + (msecs % 1000) * 1000;
+    if(usecs < 1000000) {
+        d->tv_usec = usecs;
+    } else {
+        d->tv_usec = usecs - 1000000;
+        d->tv_sec++;
+    }
+}
+
 void
 timeval_min_sec(struct timeval *d, int secs)
 {
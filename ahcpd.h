@@ -71,10 +71,32 @@ extern int nodns, af, request_prefix_delegation;
 extern char *config_script;
 extern int debug;
 extern unsigned char myid[8];
+
+/* An AHCP domain is a multicast group and a port, with its own socket.
+   Domain 0 is the one given by -m and -p, which we serve or are a client
+   of; any others are only forwarded. */
+struct domain {
+    struct in6_addr group;
+    unsigned int port;
+    int socket;
+    unsigned int kernel_dropped; /* as last reported by SO_RXQ_OVFL */
+    unsigned int kernel_logged;  /* kernel_dropped when last logged */
+};
+
+#define MAXDOMAINS 8
+extern struct domain domains[MAXDOMAINS];
+extern int numdomains;
+
 extern int numnetworks;
 struct network {
     char *ifname;
     int ifindex;
+    /* The group and port of each domain, scoped to this interface. */
+    struct sockaddr_in6 group[MAXDOMAINS];
+    struct server_config *server_config;
+    unsigned long multicast_received, unicast_received;
+    int forward;                /* forward packets to and from here */
+    int split_horizon;          /* don't flood back out of this interface */
 };
 
 #define MAXNETWORKS 20
@@ -86,6 +108,9 @@ extern int protocol_socket;
 
 extern const unsigned char zeroes[16], ones[16];
 
+extern struct timeval now;
+
+unsigned roughly(unsigned value);
 void timeval_min(struct timeval *d, const struct timeval *s);
 void timeval_min_sec(struct timeval *d, int secs);
 void timeval_minus(struct timeval *d,
@@ -95,6 +120,7 @@ void timeval_plus_msec(struct timeval *d,
                        const struct timeval *s, int msecs);
 int timeval_compare(const struct timeval *s1, const struct timeval *s2);
 int clock_stepped();
+void high_water_alarm(int high, const char *name, const char *percent);
 void do_debugf(int level, const char *format, ...)
     ATTRIBUTE ((format (printf, 2, 3))) COLD;
 
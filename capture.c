@@ -0,0 +1,214 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "capture.h"
+
+/* The file starts with a magic number, followed by records made of a
+   fixed-size header and the datagram.  Integers are big-endian.
+   Interfaces are recorded by name, since indices are local to a host. */
+
+#define MAGIC "AHCPCAP2"
+#define HEADER_SIZE 62
+
+static FILE *capture = NULL, *replay = NULL;
+
+/* The last interface looked up, in either direction. */
+static int cached_ifindex = 0;
+static char cached_ifname[IF_NAMESIZE];
+
+static const char *
+ifindex_name(int ifindex)
+{
+    if(ifindex <= 0)
+        return "";
+    if(ifindex != cached_ifindex) {
+        if(if_indextoname(ifindex, cached_ifname) == NULL)
+            return "";
+        cached_ifindex = ifindex;
+    }
+    return cached_ifname;
+}
+
+static int
+ifname_index(const char *ifname)
+{
+    int ifindex;
+
+    if(ifname[0] == '\0')
+        return 0;
+    if(cached_ifindex > 0 && strcmp(ifname, cached_ifname) == 0)
+        return cached_ifindex;
+    ifindex = if_nametoindex(ifname);
+    if(ifindex > 0) {
+        cached_ifindex = ifindex;
+        strcpy(cached_ifname, ifname);
+    }
+    return ifindex;
+}
+
+static void
+put32(unsigned char *p, unsigned v)
+{
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static void
+put16(unsigned char *p, unsigned v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static unsigned
+get32(const unsigned char *p)
+{
+    return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned
+get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+int
+capture_open(const char *filename)
+{
+    capture = fopen(filename, "w");
+    if(capture == NULL)
+        return -1;
+
+    if(fwrite(MAGIC, 8, 1, capture) != 1) {
+        fclose(capture);
+        capture = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+int
+capture_write(const struct capture_record *rec, const unsigned char *buf)
+{
+    unsigned char header[HEADER_SIZE];
+
+    if(capture == NULL)
+        return 0;
+
+    memset(header, 0, HEADER_SIZE);
+    put32(header, rec->time.tv_sec);
+    put32(header + 4, rec->time.tv_usec);
+    put16(header + 8, rec->domain);
+    put16(header + 10, rec->len);
+    memcpy(header + 12, &rec->from.sin6_addr, 16);
+    memcpy(header + 28, &rec->from.sin6_port, 2);
+    memcpy(header + 30, &rec->dst, 16);
+    strncpy((char*)header + 46, ifindex_name(rec->ifindex), IF_NAMESIZE);
+
+    if(fwrite(header, HEADER_SIZE, 1, capture) != 1 ||
+       (rec->len > 0 && fwrite(buf, rec->len, 1, capture) != 1)) {
+        perror("write(capture)");
+        fclose(capture);
+        capture = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+void
+capture_close(void)
+{
+    if(capture) {
+        fclose(capture);
+        capture = NULL;
+    }
+}
+
+int
+replay_open(const char *filename)
+{
+    char magic[8];
+
+    replay = fopen(filename, "r");
+    if(replay == NULL)
+        return -1;
+
+    if(fread(magic, 8, 1, replay) != 1 || memcmp(magic, MAGIC, 8) != 0) {
+        fclose(replay);
+        replay = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 1;
+}
+
+/* Returns 1 if a record was read, 0 at the end of the file. */
+int
+replay_read(struct capture_record *rec, unsigned char *buf, int buflen)
+{
+    unsigned char header[HEADER_SIZE];
+    char ifname[IF_NAMESIZE + 1];
+
+    if(replay == NULL)
+        return 0;
+
+    if(fread(header, HEADER_SIZE, 1, replay) != 1)
+        goto eof;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->time.tv_sec = get32(header);
+    rec->time.tv_usec = get32(header + 4);
+    rec->domain = get16(header + 8);
+    rec->len = get16(header + 10);
+    rec->from.sin6_family = AF_INET6;
+    memcpy(&rec->from.sin6_addr, header + 12, 16);
+    memcpy(&rec->from.sin6_port, header + 28, 2);
+    memcpy(&rec->dst, header + 30, 16);
+    memcpy(ifname, header + 46, IF_NAMESIZE);
+    ifname[IF_NAMESIZE] = '\0';
+    rec->ifindex = ifname_index(ifname);
+    if(IN6_IS_ADDR_LINKLOCAL(&rec->from.sin6_addr))
+        rec->from.sin6_scope_id = rec->ifindex;
+
+    if(rec->len > buflen) {
+        fprintf(stderr, "Oversized packet in capture.\n");
+        goto eof;
+    }
+    if(rec->len > 0 && fread(buf, rec->len, 1, replay) != 1)
+        goto eof;
+    return 1;
+
+ eof:
+    fclose(replay);
+    replay = NULL;
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* A received datagram, as recorded by -w and read back by -r. */
+
+struct capture_record {
+    struct timeval time;        /* monotonic */
+    int ifindex;
+    int domain;
+    struct sockaddr_in6 from;
+    struct in6_addr dst;
+    int len;
+};
+
+int capture_open(const char *filename);
+int capture_write(const struct capture_record *rec, const unsigned char *buf);
+void capture_close(void);
+int replay_open(const char *filename);
+int replay_read(struct capture_record *rec, unsigned char *buf, int buflen);
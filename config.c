@@ -30,8 +30,21 @@ THE SOFTWARE.
 
 int client_config = 1;
 
+char *relay_addresses[MAX_RELAYS];
+int num_relay_addresses = 0;
+
+/* Socket buffer sizes, 0 for the system default. */
+int receive_buffer = 0, send_buffer = 0;
+
+/* Domains that are only forwarded, in addition to the main one. */
+char *domain_groups[MAX_EXTRA_DOMAINS];
+int domain_ports[MAX_EXTRA_DOMAINS];
+int num_extra_domains = 0;
+
 struct server_config *server_config = NULL;
 
+struct interface_config *interface_configs = NULL;
+
 /* get_next_char callback */
 typedef int (*gnc_t)(void*);
 
@@ -123,11 +136,69 @@ getstring(int c, char **token_r, gnc_t gnc, void *closure)
     return c;
 }
 
+struct interface_config *
+find_interface_config(const char *ifname)
+{
+    struct interface_config *iface;
+
+    for(iface = interface_configs; iface; iface = iface->next) {
+        if(strcmp(iface->ifname, ifname) == 0)
+            return iface;
+    }
+    return NULL;
+}
+
+/* Interface configurations inherit the default name and NTP servers
+   and high-water mark. */
+static void
+inherit_server_config(struct server_config *sc)
+{
+    if(sc == server_config)
+        return;
+
+    if(!sc->name_server && server_config->name_server)
+        sc->name_server = copy_prefix_list(server_config->name_server);
+    if(!sc->ntp_server && server_config->ntp_server)
+        sc->ntp_server = copy_prefix_list(server_config->ntp_server);
+    if(sc->high_water == 0)
+        sc->high_water = server_config->high_water;
+}
+
+/* Leased IPv6 addresses must lie within a prefix that we announce, or
+   they won't be routable. */
+static int
+check_address_prefix(struct server_config *sc)
+{
+    struct prefix outer, inner;
+    int i;
+
+    if(!sc->address_prefix)
+        return 1;
+    if(!sc->ipv6_prefix)
+        return -1;
+
+    for(i = 0; i < sc->ipv6_prefix->n; i++) {
+        outer = sc->ipv6_prefix->l[i];
+        if(outer.plen > sc->address_prefix->l[0].plen)
+            continue;
+        inner = sc->address_prefix->l[0];
+        inner.plen = outer.plen;
+        mask_prefix(&outer);
+        mask_prefix(&inner);
+        if(memcmp(outer.p, inner.p, 16) == 0)
+            return 1;
+    }
+    return -1;
+}
+
 static int
 parse_config(gnc_t gnc, void *closure)
 {
     int c;
     char *token;
+    struct interface_config *iface = NULL;
+    struct server_config *sc;
+    struct interface_config *i;
 
     c = gnc(closure);
     if(c < 2)
@@ -145,9 +216,14 @@ parse_config(gnc_t gnc, void *closure)
         if(c < -1)
             return -1;
 
+        sc = iface ? iface->server_config : server_config;
+
         if(strcmp(token, "mode") == 0) {
             char *mtoken;
 
+            if(iface)
+                return -1;
+
             c = getword(c, &mtoken, gnc, closure);
             if(c < -1)
                 return -1;
@@ -159,6 +235,14 @@ parse_config(gnc_t gnc, void *closure)
                     server_config = calloc(1, sizeof(struct server_config));
                 if(!server_config)
                     return -1;
+                /* Interfaces may have been declared before this line. */
+                for(i = interface_configs; i; i = i->next) {
+                    if(!i->server_config)
+                        i->server_config =
+                            calloc(1, sizeof(struct server_config));
+                    if(!i->server_config)
+                        return -1;
+                }
 #else
                 return -1;
 #endif
@@ -176,13 +260,166 @@ parse_config(gnc_t gnc, void *closure)
 
             free(mtoken);
 
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "link-type") == 0) {
+            char *ltoken;
+
+            if(!iface)
+                return -1;
+
+            c = getword(c, &ltoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            if(strcmp(ltoken, "wired") == 0)
+                iface->wired = 1;
+            else if(strcmp(ltoken, "wireless") == 0)
+                iface->wired = 0;
+            else
+                return -1;
+
+            free(ltoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "forward") == 0 ||
+                  strcmp(token, "split-horizon") == 0) {
+            char *btoken;
+            int value;
+
+            if(!iface)
+                return -1;
+
+            c = getword(c, &btoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            if(strcmp(btoken, "true") == 0)
+                value = 1;
+            else if(strcmp(btoken, "false") == 0)
+                value = 0;
+            else
+                return -1;
+
+            if(strcmp(token, "forward") == 0)
+                iface->forward = value;
+            else
+                iface->split_horizon = value;
+
+            free(btoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "relay") == 0) {
+            char *address;
+
+            if(client_config || server_config || iface)
+                return -1;
+
+            if(num_relay_addresses >= MAX_RELAYS)
+                return -1;
+
+            c = getword(c, &address, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            relay_addresses[num_relay_addresses++] = address;
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "receive-buffer") == 0 ||
+                  strcmp(token, "send-buffer") == 0) {
+            char *btoken;
+            int size;
+
+            if(iface)
+                return -1;
+
+            c = getword(c, &btoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            size = atoi(btoken);
+            if(size <= 0)
+                return -1;
+
+            if(strcmp(token, "receive-buffer") == 0)
+                receive_buffer = size;
+            else
+                send_buffer = size;
+
+            free(btoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "domain") == 0) {
+            char *gtoken, *ptoken;
+            int port;
+
+            if(iface || num_extra_domains >= MAX_EXTRA_DOMAINS)
+                return -1;
+
+            c = getword(c, &gtoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            c = getword(c, &ptoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            port = atoi(ptoken);
+            if(port <= 0 || port > 0xFFFF)
+                return -1;
+
+            domain_groups[num_extra_domains] = gtoken;
+            domain_ports[num_extra_domains] = port;
+            num_extra_domains++;
+            free(ptoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "global") == 0) {
+            /* End of an interface block. */
+            iface = NULL;
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "interface") == 0) {
+            char *ifname;
+
+            c = getword(c, &ifname, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            iface = find_interface_config(ifname);
+            if(iface) {
+                free(ifname);
+            } else {
+                iface = calloc(1, sizeof(struct interface_config));
+                if(iface == NULL)
+                    return -1;
+                iface->ifname = ifname;
+                iface->forward = 1;
+                iface->split_horizon = -1;
+                if(server_config) {
+                    iface->server_config =
+                        calloc(1, sizeof(struct server_config));
+                    if(iface->server_config == NULL)
+                        return -1;
+                }
+                iface->next = interface_configs;
+                interface_configs = iface;
+            }
+
             c = skip_eol(c, gnc, closure);
             if(c < -1)
                 return -1;
         } else if(strcmp(token, "lease-dir") == 0) {
             char *dir;
 
-            if(!server_config)
+            if(!server_config || iface)
                 return -1;
 
             c = getstring(c, &dir, gnc, closure);
@@ -196,11 +433,158 @@ parse_config(gnc_t gnc, void *closure)
             c = skip_eol(c, gnc, closure);
             if(c < -1)
                 return -1;
+        } else if(strcmp(token, "high-water") == 0) {
+            char *htoken;
+            int high_water;
+
+            if(!sc)
+                return -1;
+
+            c = getword(c, &htoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            high_water = atoi(htoken);
+            if(high_water <= 0 || high_water > 100)
+                return -1;
+
+            sc->high_water = high_water;
+            free(htoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "high-water-script") == 0) {
+            char *script;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getstring(c, &script, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            server_config->high_water_script = script;
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "replication") == 0) {
+            char *rtoken;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getword(c, &rtoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            if(strcmp(rtoken, "primary") == 0)
+                server_config->replication_role = REPLICATION_PRIMARY;
+            else if(strcmp(rtoken, "secondary") == 0)
+                server_config->replication_role = REPLICATION_SECONDARY;
+            else
+                return -1;
+
+            free(rtoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "lease-thread") == 0) {
+            char *btoken;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getword(c, &btoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            if(strcmp(btoken, "true") == 0)
+                server_config->lease_thread = 1;
+            else if(strcmp(btoken, "false") == 0)
+                server_config->lease_thread = 0;
+            else
+                return -1;
+
+            free(btoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "shard") == 0) {
+            char *itoken, *ctoken;
+            int index, count;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getword(c, &itoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            c = getword(c, &ctoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            index = atoi(itoken);
+            count = atoi(ctoken);
+            if(count < 1 || count > 256 || index < 0 || index >= count)
+                return -1;
+
+            server_config->shard_index = index;
+            server_config->shard_count = count;
+            free(itoken);
+            free(ctoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "replication-peer") == 0) {
+            char *ptoken;
+            int port;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getword(c, &server_config->replication_peer, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            c = getword(c, &ptoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            port = atoi(ptoken);
+            if(port <= 0 || port > 0xFFFF)
+                return -1;
+
+            server_config->replication_peer_port = port;
+            free(ptoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "replication-port") == 0) {
+            char *ptoken;
+            int port;
+
+            if(!server_config || iface)
+                return -1;
+
+            c = getword(c, &ptoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            port = atoi(ptoken);
+            if(port <= 0 || port > 0xFFFF)
+                return -1;
+
+            server_config->replication_port = port;
+            free(ptoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
         } else if(strcmp(token, "prefix") == 0) {
             char *ptoken;
             struct prefix_list *prefix;
 
-            if(!server_config)
+            if(!sc)
                 return -1;
 
             c = getword(c, &ptoken, gnc, closure);
@@ -215,7 +599,9 @@ parse_config(gnc_t gnc, void *closure)
             if(prefix_list_v4(prefix)) {
                 unsigned const char zeroes[4] = {0};
                 unsigned mask, first, last;
-                if(memcmp(server_config->lease_first, zeroes, 4) != 0)
+                if(memcmp(sc->lease_first, zeroes, 4) != 0)
+                    return -1;
+                if(prefix->l[0].plen > 96 + 30 || prefix->l[0].p[12] == 0)
                     return -1;
                 mask = 0xFFFFFFFF << (128 - prefix->l[0].plen);
                 first =
@@ -226,24 +612,93 @@ parse_config(gnc_t gnc, void *closure)
                 last = first | (~ mask);
                 first = htonl(first + 1);
                 last = htonl(last - 1);
-                memcpy(server_config->lease_first, &first, 4);
-                memcpy(server_config->lease_last, &last, 4);
+                memcpy(sc->lease_first, &first, 4);
+                memcpy(sc->lease_last, &last, 4);
                 free(prefix);
             } else {
-                server_config->ipv6_prefix =
-                    cat_prefix_list(server_config->ipv6_prefix,
+                sc->ipv6_prefix =
+                    cat_prefix_list(sc->ipv6_prefix,
                                     prefix);
             }
             free(ptoken);
             c = skip_eol(c, gnc, closure);
             if(c < -1)
                 return -1;
+        } else if(strcmp(token, "address-prefix") == 0) {
+            char *ptoken;
+            struct prefix_list *prefix;
+
+            if(!sc || sc->address_prefix)
+                return -1;
+
+            c = getword(c, &ptoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            prefix = parse_prefix(ptoken, PREFIX);
+
+            if(prefix == NULL || prefix->n != 1 ||
+               prefix_list_v4(prefix) || prefix->l[0].plen != 64)
+                return -1;
+
+            sc->address_prefix = prefix;
+            free(ptoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
+        } else if(strcmp(token, "delegate") == 0) {
+            char *ptoken, *ltoken;
+            struct prefix_list *prefix;
+            int plen;
+
+            if(!sc)
+                return -1;
+
+            c = getword(c, &ptoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            c = getword(c, &ltoken, gnc, closure);
+            if(c < -1)
+                return -1;
+
+            prefix = parse_prefix(ptoken, PREFIX);
+
+            if(prefix == NULL || prefix->n != 1)
+                return -1;
+
+            plen = atoi(ltoken);
+
+            /* Delegated prefixes are carved out of the masked pool. */
+            mask_prefix(&prefix->l[0]);
+
+            if(prefix_list_v4(prefix)) {
+                if(sc->ipv4_delegation || plen <= 0 || plen > 32)
+                    return -1;
+                plen += 96;
+                sc->ipv4_delegation = prefix;
+                sc->ipv4_delegation_plen = plen;
+            } else {
+                if(sc->ipv6_delegation || plen <= 0 || plen > 128)
+                    return -1;
+                sc->ipv6_delegation = prefix;
+                sc->ipv6_delegation_plen = plen;
+            }
+
+            if(plen <= prefix->l[0].plen)
+                return -1;
+
+            free(ptoken);
+            free(ltoken);
+            c = skip_eol(c, gnc, closure);
+            if(c < -1)
+                return -1;
         } else if(strcmp(token, "name-server") == 0 ||
                   strcmp(token, "ntp-server") == 0) {
             char *ptoken;
             struct prefix_list *prefix;
 
-            if(!server_config)
+            if(!sc)
                 return -1;
 
             c = getword(c, &ptoken, gnc, closure);
@@ -256,12 +711,12 @@ parse_config(gnc_t gnc, void *closure)
                 return -1;
 
             if(strcmp(token, "name-server") == 0)
-                server_config->name_server =
-                    cat_prefix_list(server_config->name_server,
+                sc->name_server =
+                    cat_prefix_list(sc->name_server,
                                     prefix);
             else
-                server_config->ntp_server =
-                    cat_prefix_list(server_config->ntp_server,
+                sc->ntp_server =
+                    cat_prefix_list(sc->ntp_server,
                                     prefix);
             free(ptoken);
         } else {
@@ -269,6 +724,18 @@ parse_config(gnc_t gnc, void *closure)
         }
         free(token);
     }
+
+    if(server_config) {
+        if(check_address_prefix(server_config) < 0)
+            return -1;
+        for(i = interface_configs; i; i = i->next) {
+            if(i->server_config) {
+                inherit_server_config(i->server_config);
+                if(check_address_prefix(i->server_config) < 0)
+                    return -1;
+            }
+        }
+    }
     return 1;
 }
 
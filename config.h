@@ -20,14 +20,53 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#define REPLICATION_NONE 0
+#define REPLICATION_PRIMARY 1
+#define REPLICATION_SECONDARY 2
+
 struct server_config {
     const char *lease_dir;
     struct prefix_list *name_server, *ntp_server, *ipv6_prefix;
+    struct prefix_list *address_prefix;
     unsigned char lease_first[4], lease_last[4];
+    /* Delegated prefix lengths are in the same format as in struct prefix,
+       i.e. offset by 96 for IPv4. */
+    struct prefix_list *ipv6_delegation, *ipv4_delegation;
+    int ipv6_delegation_plen, ipv4_delegation_plen;
+    int high_water;             /* percentage of a pool, 0 if none */
+    char *high_water_script;
+    int replication_role;
+    char *replication_peer;
+    int replication_peer_port, replication_port;
+    int lease_thread;           /* run the lease database in a thread */
+    int shard_index, shard_count; /* this server's share of client ids */
+};
+
+/* Statements following an interface statement only apply to that
+   interface. */
+struct interface_config {
+    char *ifname;
+    struct server_config *server_config;
+    int wired;
+    int forward;
+    int split_horizon;          /* -1 to follow the link type */
+    struct interface_config *next;
 };
 
+#define MAX_RELAYS 8
+#define MAX_EXTRA_DOMAINS 7
+
 extern int client_config;
+extern char *relay_addresses[MAX_RELAYS];
+extern int num_relay_addresses;
+extern int receive_buffer, send_buffer;
+extern char *domain_groups[MAX_EXTRA_DOMAINS];
+extern int domain_ports[MAX_EXTRA_DOMAINS];
+extern int num_extra_domains;
 extern struct server_config *server_config;
+extern struct interface_config *interface_configs;
+
+struct interface_config *find_interface_config(const char *ifname);
 
 int parse_config_from_string(char *string);
 int parse_config_from_file(char *filename);
@@ -54,6 +54,7 @@ THE SOFTWARE.
 #include "config.h"
 #include "protocol.h"
 #include "configure.h"
+#include "event.h"
 
 struct config_data *config_data = NULL;
 const unsigned char v4prefix[16] = 
@@ -124,6 +125,7 @@ run_script(const char *action, struct config_data *config, char **interfaces)
     } else if(pid == 0) {
         char buf[201];
         int i;
+        event_child();
         snprintf(buf, 50, "%lu", (unsigned long)getppid());
         setenv("AHCP_DAEMON_PID", buf, 1);
         buf[0] = '\0';
@@ -282,8 +284,10 @@ config_data_compatible(struct config_data *config1, struct config_data *config2)
 }
 
 struct config_data *
-make_config_data(int expires,
-                 unsigned char *ipv4, struct server_config *server_config,
+make_config_data(int expires, unsigned char *ipv4, unsigned char *ipv6,
+                 struct prefix *ipv6_delegation,
+                 struct prefix *ipv4_delegation,
+                 struct server_config *server_config,
                  char **interfaces)
 {
     struct config_data *config;
@@ -308,9 +312,18 @@ make_config_data(int expires,
     if(ipv4)
         config->ipv4_address = raw_prefix_list(ipv4, 4, IPv4_ADDRESS);
 
+    if(ipv6)
+        config->ipv6_address = raw_prefix_list(ipv6, 16, IPv6_ADDRESS);
+
     if(server_config->ipv6_prefix)
         config->ipv6_prefix = copy_prefix_list(server_config->ipv6_prefix);
 
+    if(ipv6_delegation)
+        config->ipv6_prefix_delegation = single_prefix_list(ipv6_delegation);
+
+    if(ipv4_delegation)
+        config->ipv4_prefix_delegation = single_prefix_list(ipv4_delegation);
+
     if(server_config->name_server)
         config->name_server = copy_prefix_list(server_config->name_server);
 
@@ -722,6 +735,32 @@ server_body(unsigned char opcode, struct config_data *config,
         }
     }
 
+    if(config->ipv6_prefix_delegation) {
+        int j;
+        buf[i++] = OPT_IPv6_PREFIX_DELEGATION; if(i >= buflen) goto fail;
+        buf[i++] = 17 * config->ipv6_prefix_delegation->n;
+        if(i >= buflen) goto fail;
+        for(j = 0; j < config->ipv6_prefix_delegation->n; j++) {
+            if(i >= buflen - 17) goto fail;
+            memcpy(buf + i, config->ipv6_prefix_delegation->l[j].p, 16);
+            i += 16;
+            buf[i++] = config->ipv6_prefix_delegation->l[j].plen;
+        }
+    }
+
+    if(config->ipv4_prefix_delegation) {
+        int j;
+        buf[i++] = OPT_IPv4_PREFIX_DELEGATION; if(i >= buflen) goto fail;
+        buf[i++] = 5 * config->ipv4_prefix_delegation->n;
+        if(i >= buflen) goto fail;
+        for(j = 0; j < config->ipv4_prefix_delegation->n; j++) {
+            if(i >= buflen - 5) goto fail;
+            memcpy(buf + i, config->ipv4_prefix_delegation->l[j].p + 12, 4);
+            i += 4;
+            buf[i++] = config->ipv4_prefix_delegation->l[j].plen - 96;
+        }
+    }
+
     if(config->name_server) {
         int j;
         buf[i++] = OPT_NAME_SERVER; if(i >= buflen) goto fail;
@@ -45,6 +45,9 @@ int config_data_compatible(struct config_data *config1,
 struct config_data *copy_config_data(struct config_data *config);
 struct config_data *make_config_data(int expires,
                                      unsigned char *ipv4,
+                                     unsigned char *ipv6,
+                                     struct prefix *ipv6_delegation,
+                                     struct prefix *ipv4_delegation,
                                      struct server_config *server_config,
                                      char **interfaces);
 
@@ -0,0 +1,293 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#define _GNU_SOURCE 1
+
+#if defined(__linux__)
+#define HAVE_EPOLL
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
+
+#include "event.h"
+
+/* The main loop waits on a fixed set of file descriptors.  On Linux, this
+   is an epoll set, timeouts are delivered through a timerfd and signals
+   through a signalfd, so that signal handlers run synchronously from
+   event_wait.  Elsewhere, we fall back to select and sigaction. */
+
+#define MAX_EVENT_FDS 16
+
+static int ready[MAX_EVENT_FDS];
+static int numready = 0;
+
+#ifdef HAVE_EPOLL
+static int epoll_fd = -1, timer_fd = -1, signal_fd = -1;
+static sigset_t signals;
+static void (*handlers[NSIG])(int);
+#else
+static int fds[MAX_EVENT_FDS];
+static int numfds = 0;
+#endif
+
+int
+event_init(void)
+{
+#ifdef HAVE_EPOLL
+    int rc, saved_errno;
+
+    sigemptyset(&signals);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+        return -1;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(timer_fd < 0)
+        goto fail;
+
+    rc = event_add(timer_fd);
+    if(rc < 0)
+        goto fail;
+
+    return 1;
+
+ fail:
+    saved_errno = errno;
+    if(timer_fd >= 0)
+        close(timer_fd);
+    close(epoll_fd);
+    timer_fd = epoll_fd = -1;
+    errno = saved_errno;
+    return -1;
+#else
+    return 1;
+#endif
+}
+
+int
+event_add(int fd)
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    if(numfds >= MAX_EVENT_FDS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    fds[numfds++] = fd;
+    return 0;
+#endif
+}
+
+int
+event_del(int fd)
+{
+    int i;
+
+    for(i = 0; i < numready; i++) {
+        if(ready[i] == fd)
+            ready[i] = -1;
+    }
+
+#ifdef HAVE_EPOLL
+    return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    for(i = 0; i < numfds; i++) {
+        if(fds[i] == fd) {
+            fds[i] = fds[--numfds];
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+#endif
+}
+
+int
+event_signal(int signo, void (*handler)(int))
+{
+#ifdef HAVE_EPOLL
+    int rc;
+
+    if(signo <= 0 || signo >= NSIG) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    handlers[signo] = handler;
+    sigaddset(&signals, signo);
+
+    rc = sigprocmask(SIG_BLOCK, &signals, NULL);
+    if(rc < 0)
+        return -1;
+
+    rc = signalfd(signal_fd, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(rc < 0)
+        return -1;
+
+    if(signal_fd < 0) {
+        signal_fd = rc;
+        rc = event_add(signal_fd);
+        if(rc < 0)
+            return -1;
+    }
+    return 0;
+#else
+    struct sigaction sa;
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handler;
+    sa.sa_flags = 0;
+    return sigaction(signo, &sa, NULL);
+#endif
+}
+
+/* Called in a child process before exec: the signals delivered through
+   the signalfd are blocked, as is everything in the lease thread, and the
+   mask is inherited. */
+
+void
+event_child(void)
+{
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+void
+event_reset(void)
+{
+    numready = 0;
+}
+
+/* Wait until one of our file descriptors becomes readable, a signal is
+   delivered, or timeout expires.  A null timeout waits forever.  Returns
+   the number of readable file descriptors. */
+
+int
+event_wait(const struct timeval *timeout)
+{
+#ifdef HAVE_EPOLL
+    struct epoll_event events[MAX_EVENT_FDS];
+    struct itimerspec its;
+    int i, n, rc, block = 1;
+
+    numready = 0;
+
+    if(timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0) {
+        block = 0;
+    } else {
+        memset(&its, 0, sizeof(its));
+        if(timeout) {
+            its.it_value.tv_sec = timeout->tv_sec;
+            its.it_value.tv_nsec = timeout->tv_usec * 1000;
+        }
+        rc = timerfd_settime(timer_fd, 0, &its, NULL);
+        if(rc < 0)
+            return -1;
+    }
+
+    n = epoll_wait(epoll_fd, events, MAX_EVENT_FDS, block ? -1 : 0);
+    if(n < 0)
+        return -1;
+
+    for(i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if(fd == timer_fd) {
+            uint64_t expirations;
+            rc = read(timer_fd, &expirations, sizeof(expirations));
+        } else if(fd == signal_fd) {
+            struct signalfd_siginfo si;
+            while(read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+                if(si.ssi_signo < NSIG && handlers[si.ssi_signo])
+                    handlers[si.ssi_signo](si.ssi_signo);
+            }
+        } else {
+            ready[numready++] = fd;
+        }
+    }
+
+    return numready;
+#else
+    fd_set readfds;
+    struct timeval tv;
+    int i, rc, maxfd = -1;
+
+    numready = 0;
+
+    FD_ZERO(&readfds);
+    for(i = 0; i < numfds; i++) {
+        FD_SET(fds[i], &readfds);
+        if(fds[i] > maxfd)
+            maxfd = fds[i];
+    }
+
+    if(timeout)
+        tv = *timeout;
+    rc = select(maxfd + 1, &readfds, NULL, NULL, timeout ? &tv : NULL);
+    if(rc < 0)
+        return -1;
+
+    for(i = 0; i < numfds; i++) {
+        if(FD_ISSET(fds[i], &readfds))
+            ready[numready++] = fds[i];
+    }
+
+    return numready;
+#endif
+}
+
+int
+event_ready(int fd)
+{
+    int i;
+
+    if(fd < 0)
+        return 0;
+
+    for(i = 0; i < numready; i++) {
+        if(ready[i] == fd)
+            return 1;
+    }
+    return 0;
+}
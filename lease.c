@@ -37,19 +37,22 @@ THE SOFTWARE.
 
 #include "ahcpd.h"
 #include "monotonic.h"
+#include "prefix.h"
 #include "lease.h"
+#include "replication.h"
+#include "event.h"
 
 #ifdef NO_SERVER
 
 int
-lease_init(const char *dir,
-           const unsigned char *first, const unsigned char *last, int debug)
+lease_init(const char *dir, int debug)
 {
     return -1;
 }
 
 int
 take_lease(const unsigned char *client_id, int client_len,
+           const unsigned char *first, const unsigned char *last,
            const unsigned char *suggested_ipv4,
            unsigned char *ipv4_return, unsigned *lease_time, int commit)
 {
@@ -63,28 +66,113 @@ release_lease(const unsigned char *client_id, int client_len,
     return -1;
 }
 
+int
+address_pool_init(const unsigned char *first, const unsigned char *last,
+                  int high_water)
+{
+    return -1;
+}
+
+int
+ipv6_pool_init(const struct prefix *prefix, int high_water)
+{
+    return -1;
+}
+
+int
+delegation_init(const struct prefix *parent, int plen, int high_water)
+{
+    return -1;
+}
+
+int
+take_delegation(const unsigned char *client_id, int client_len,
+                const struct prefix *parent,
+                struct prefix *prefix_return, unsigned *lease_time,
+                int commit)
+{
+    return -1;
+}
+
+int
+take_ipv6_lease(const unsigned char *client_id, int client_len,
+                const struct prefix *pool,
+                unsigned char *ipv6_return, unsigned *lease_time, int commit)
+{
+    return -1;
+}
+
+int
+release_client_leases(const unsigned char *client_id, int client_len)
+{
+    return -1;
+}
+
+int
+client_bound(const unsigned char *client_id, int client_len)
+{
+    return 0;
+}
+
+void
+lease_check(void)
+{
+    return;
+}
+
+void
+lease_dump(void)
+{
+    return;
+}
+
+int
+lease_walk(int *cursor, struct lease_update *update)
+{
+    return 0;
+}
+
+int
+apply_lease(const struct lease_update *update, unsigned remaining)
+{
+    return -1;
+}
+
 #else
 
 #define LEASE_GRACE_TIME 666
 #define LEASE_PURGE_TIME (16 * 24 * 3600 + 666)
 
-static unsigned int first_address = 0, last_address = 0;
+/* The number of interface identifiers we try for a new IPv6 lease. */
+#define IPv6_LEASE_PROBES 16
+
 const char *lease_directory = NULL;
+const char *high_water_script = NULL;
 
-/* A table mapping known IPs to leases.  If an entry is missing, everything
-   is still safe, although we might be unable to give out leases in some
-   cases; however, if it is incorrect, then we might incorrectly expire
-   relative leases. */
+/* A table mapping known addresses and delegated prefixes to leases.  If an
+   entry is missing, everything is still safe, although we might be unable
+   to give out leases in some cases; however, if it is incorrect, then we
+   might incorrectly expire relative leases. */
 
 #define MAX_LEASE_ENTRIES 16384
 
+/* An entry is bound until its lease ends, then reserved for the grace
+   time, then expired until its lease file is purged. */
+
+#define LEASE_BOUND 0
+#define LEASE_RESERVED 1
+#define LEASE_EXPIRED 2
+
 struct lease_entry {
     unsigned char *id;
     int id_len;
-    unsigned address;
+    struct prefix key;          /* an address or a delegated prefix */
     unsigned lease_orig;        /* real time, 0 if unknown */
     unsigned lease_time;
     time_t lease_end_m;         /* monotonic time, may be negative if expired */
+    struct lease_pool *pool;    /* NULL if not in any pool */
+    int state;                  /* -1 if not accounted for */
+    int next_id;                /* next entry in the same id bucket */
 };
 
 static struct lease_entry *entries = NULL;
@@ -92,6 +180,52 @@ static struct lease_entry *entries = NULL;
 static int numentries = 0;
 static int maxentries = 0;
 
+/* Entries are also chained by client id, so that a client's leases can
+   be found without scanning the table.  Chains hold indices into
+   entries, and end with -1. */
+
+#define ID_BUCKETS 4096
+
+static int id_buckets[ID_BUCKETS];
+
+/* The earliest time at which an entry changes state, 0 if none. */
+static time_t next_transition = 0;
+
+/* A pool is a range we allocate from: a range of IPv4 addresses, a /64
+   for IPv6 addresses, or a parent prefix for delegation.  Pools keep
+   counts of their entries in each state, so that occupancy is known
+   without scanning the table.
+
+   Delegated prefixes are carved out of a parent prefix by a buddy
+   allocator restricted to a single block size.  The trie is indexed by
+   the bits of the delegated prefix below the parent; a missing node is
+   entirely free, and a node is full when all the blocks below it are
+   taken.  A block is taken whenever we have an entry for it. */
+
+struct pool_node {
+    struct pool_node *child[2];
+    int full;
+};
+
+struct lease_pool {
+    int kind;                   /* the kind of the keys in this pool */
+    struct prefix parent;       /* unused for IPv4 addresses */
+    unsigned first, last;       /* IPv4 addresses only */
+    unsigned char plen;         /* length of delegated prefixes */
+    struct pool_node *root;
+    unsigned size;              /* 0 if too large to count */
+    unsigned count[3];
+    int high_water;             /* percentage, 0 if none */
+    int alarm;
+};
+
+#define MAX_POOLS 16
+
+static struct lease_pool pools[MAX_POOLS];
+static int numpools = 0;
+
+static char *lease_name(const struct prefix *key, char *buf, int bufsize);
+
 static unsigned char *
 address_ipv4(unsigned a, unsigned char *ipv4)
 {
@@ -108,6 +242,50 @@ ipv4_address(const unsigned char *ipv4)
     return ntohl(a);
 }
 
+static struct prefix *
+ipv4_key(const unsigned char *ipv4, struct prefix *key)
+{
+    memcpy(key->p, v4prefix, 12);
+    memcpy(key->p + 12, ipv4, 4);
+    key->plen = 0xFF;
+    return key;
+}
+
+static struct prefix *
+address_key(unsigned a, struct prefix *key)
+{
+    unsigned char ipv4[4];
+    return ipv4_key(address_ipv4(a, ipv4), key);
+}
+
+static int
+key_kind(const struct prefix *key)
+{
+    int v4 = memcmp(key->p, v4prefix, 12) == 0;
+    if(key->plen == 0xFF)
+        return v4 ? IPv4_ADDRESS : IPv6_ADDRESS;
+    else
+        return v4 ? IPv4_PREFIX : IPv6_PREFIX;
+}
+
+static int
+key_eq(const struct prefix *key1, const struct prefix *key2)
+{
+    return key1->plen == key2->plen && memcmp(key1->p, key2->p, 16) == 0;
+}
+
+static int
+prefix_within(const unsigned char *p, const struct prefix *parent)
+{
+    int n = parent->plen / 8, r = parent->plen % 8;
+
+    if(memcmp(p, parent->p, n) != 0)
+        return 0;
+    if(r == 0)
+        return 1;
+    return ((p[n] ^ parent->p[n]) & (0xFF << (8 - r)) & 0xFF) == 0;
+}
+
 static int
 entry_match(struct lease_entry *entry, const unsigned char *id, int id_len)
 {
@@ -117,23 +295,312 @@ entry_match(struct lease_entry *entry, const unsigned char *id, int id_len)
     return (entry->id_len == id_len && memcmp(entry->id, id, id_len) == 0);
 }
 
+static int *
+id_bucket(const unsigned char *id, int id_len)
+{
+    unsigned h = 2166136261U;
+    int i;
+
+    for(i = 0; i < id_len; i++)
+        h = (h ^ id[i]) * 16777619U;
+    return &id_buckets[h % ID_BUCKETS];
+}
+
+static void
+unlink_id(struct lease_entry *entry)
+{
+    int *p = id_bucket(entry->id, entry->id_len);
+
+    while(*p >= 0) {
+        if(&entries[*p] == entry) {
+            *p = entry->next_id;
+            return;
+        }
+        p = &entries[*p].next_id;
+    }
+}
+
+/* Pools are disjoint, so a key is in at most one pool. */
+static struct lease_pool *
+key_pool(const struct prefix *key)
+{
+    int i, kind = key_kind(key);
+    unsigned a;
+
+    for(i = 0; i < numpools; i++) {
+        if(pools[i].kind != kind)
+            continue;
+        if(kind == IPv4_ADDRESS) {
+            a = ipv4_address(key->p + 12);
+            if(a >= pools[i].first && a <= pools[i].last)
+                return &pools[i];
+        } else if(prefix_within(key->p, &pools[i].parent)) {
+            if(kind == IPv6_ADDRESS || key->plen == pools[i].plen)
+                return &pools[i];
+        }
+    }
+    return NULL;
+}
+
+static struct lease_pool *
+find_pool(const struct prefix *parent)
+{
+    int i;
+    for(i = 0; i < numpools; i++) {
+        if((pools[i].kind == IPv4_PREFIX || pools[i].kind == IPv6_PREFIX) &&
+           key_eq(&pools[i].parent, parent))
+            return &pools[i];
+    }
+    return NULL;
+}
+
+static struct lease_pool *
+find_address_pool(unsigned first, unsigned last)
+{
+    int i;
+    for(i = 0; i < numpools; i++) {
+        if(pools[i].kind == IPv4_ADDRESS &&
+           pools[i].first == first && pools[i].last == last)
+            return &pools[i];
+    }
+    return NULL;
+}
+
+static unsigned
+pool_free(const struct lease_pool *pool)
+{
+    return pool->size - pool->count[LEASE_BOUND] -
+        pool->count[LEASE_RESERVED] - pool->count[LEASE_EXPIRED];
+}
+
+static char *
+pool_name(const struct lease_pool *pool, char *buf, int bufsize)
+{
+    char first[INET_ADDRSTRLEN], last[INET_ADDRSTRLEN];
+    unsigned char ipv4[4];
+    int rc;
+
+    if(pool->kind != IPv4_ADDRESS)
+        return lease_name(&pool->parent, buf, bufsize);
+
+    if(inet_ntop(AF_INET, address_ipv4(pool->first, ipv4),
+                 first, INET_ADDRSTRLEN) == NULL ||
+       inet_ntop(AF_INET, address_ipv4(pool->last, ipv4),
+                 last, INET_ADDRSTRLEN) == NULL)
+        return NULL;
+
+    rc = snprintf(buf, bufsize, "%s-%s", first, last);
+    if(rc < 0 || rc >= bufsize)
+        return NULL;
+    return buf;
+}
+
+/* Run the high-water script.  This forks, so it must only be called from
+   the main thread, which reaps the script's children. */
+void
+run_high_water_script(int high, const char *name, const char *percent)
+{
+    pid_t pid;
+
+    pid = fork();
+    if(pid < 0) {
+        perror("fork");
+    } else if(pid == 0) {
+        event_child();
+        execl(high_water_script, high_water_script,
+              high ? "high" : "low", name, percent, NULL);
+        perror("exec(high_water_script)");
+        _exit(1);
+    }
+}
+
+/* Called once whenever a pool crosses its high-water mark, in either
+   direction. */
+static void
+pool_alarm(struct lease_pool *pool, unsigned used)
+{
+    char name[100], percent[12];
+
+    if(pool_name(pool, name, 100) == NULL)
+        strcpy(name, "(unknown)");
+    snprintf(percent, 12, "%u",
+             (unsigned)((unsigned long long)used * 100 / pool->size));
+
+    fprintf(stderr, "Pool %s %s its high-water mark (%s%% in use).\n",
+            name, pool->alarm ? "reached" : "went below", percent);
+
+    if(high_water_script == NULL)
+        return;
+
+    high_water_alarm(pool->alarm, name, percent);
+}
+
+static void
+check_high_water(struct lease_pool *pool)
+{
+    unsigned used;
+    int alarm;
+
+    if(pool->high_water <= 0 || pool->size == 0)
+        return;
+
+    used = pool->count[LEASE_BOUND] + pool->count[LEASE_RESERVED];
+    alarm = (unsigned long long)used * 100 >=
+        (unsigned long long)pool->size * pool->high_water;
+    if(alarm != pool->alarm) {
+        pool->alarm = alarm;
+        pool_alarm(pool, used);
+    }
+}
+
+static int
+entry_state(const struct lease_entry *entry, time_t now)
+{
+    if(entry->lease_end_m > now)
+        return LEASE_BOUND;
+    else if(entry->lease_end_m + LEASE_GRACE_TIME > now)
+        return LEASE_RESERVED;
+    else
+        return LEASE_EXPIRED;
+}
+
+/* Move an entry to a new state, or to -1 if it is being removed. */
+static void
+account_entry(struct lease_entry *entry, int state)
+{
+    struct lease_pool *pool = entry->pool;
+    time_t t;
+
+    if(pool == NULL) {
+        entry->state = state;
+        return;
+    }
+
+    if(state != entry->state) {
+        if(entry->state >= 0)
+            pool->count[entry->state]--;
+        if(state >= 0)
+            pool->count[state]++;
+        entry->state = state;
+        check_high_water(pool);
+    }
+
+    if(state == LEASE_BOUND)
+        t = entry->lease_end_m;
+    else if(state == LEASE_RESERVED)
+        t = entry->lease_end_m + LEASE_GRACE_TIME;
+    else
+        return;
+
+    if(next_transition == 0 || t < next_transition)
+        next_transition = t;
+}
+
+static void
+update_entry(struct lease_entry *entry)
+{
+    struct timeval now;
+
+    gettime(&now, NULL);
+    account_entry(entry, entry_state(entry, now.tv_sec));
+}
+
+static int
+mark_node(struct pool_node **node, const unsigned char *p,
+          int bit, int left, int full)
+{
+    struct pool_node *n = *node;
+    int rc = 1;
+
+    if(n == NULL) {
+        if(!full)
+            return 1;
+        n = calloc(1, sizeof(struct pool_node));
+        if(n == NULL)
+            return -1;
+        *node = n;
+    }
+
+    if(left == 0) {
+        n->full = full;
+    } else {
+        int b = (p[bit / 8] >> (7 - bit % 8)) & 1;
+        rc = mark_node(&n->child[b], p, bit + 1, left - 1, full);
+        n->full = n->child[0] && n->child[0]->full &&
+            n->child[1] && n->child[1]->full;
+    }
+
+    if(!n->full && n->child[0] == NULL && n->child[1] == NULL) {
+        free(n);
+        *node = NULL;
+    }
+    return rc;
+}
+
+static void
+pool_mark(struct lease_pool *pool, const struct prefix *key, int full)
+{
+    int rc;
+
+    if(pool == NULL ||
+       (pool->kind != IPv4_PREFIX && pool->kind != IPv6_PREFIX))
+        return;
+
+    rc = mark_node(&pool->root, key->p, pool->parent.plen,
+                   pool->plen - pool->parent.plen, full);
+    if(rc < 0)
+        perror("mark_node");
+}
+
+/* Find the first free block in a pool. */
+static int
+pool_allocate(struct lease_pool *pool, struct prefix *key_return)
+{
+    struct pool_node *n = pool->root;
+    int bit, b;
+
+    if(n && n->full)
+        return -1;
+
+    *key_return = pool->parent;
+    key_return->plen = pool->plen;
+
+    for(bit = pool->parent.plen; bit < pool->plen; bit++) {
+        if(n == NULL || n->child[0] == NULL || !n->child[0]->full)
+            b = 0;
+        else
+            b = 1;
+        if(b)
+            key_return->p[bit / 8] |= (0x80 >> (bit % 8));
+        n = n ? n->child[b] : NULL;
+    }
+    return 1;
+}
+
 static struct lease_entry *
-find_entry(unsigned address)
+find_entry(const struct prefix *key)
 {
     int i;
     for(i = 0; i < numentries; i++) {
-        if(entries[i].address == address)
+        if(key_eq(&entries[i].key, key))
             return &entries[i];
     }
     return NULL;
 }
 
+/* Find an IPv4 lease for a client within a range. */
 static struct lease_entry *
-find_entry_by_id(const unsigned char *id, int id_len)
+find_entry_by_id(const unsigned char *id, int id_len,
+                 unsigned first, unsigned last)
 {
+    unsigned a;
     int i;
     for(i = 0; i < numentries; i++) {
-        if(entry_match(&entries[i], id, id_len))
+        if(!entry_match(&entries[i], id, id_len) ||
+           key_kind(&entries[i].key) != IPv4_ADDRESS)
+            continue;
+        a = ipv4_address(entries[i].key.p + 12);
+        if(a >= first && a <= last)
             return &entries[i];
     }
     return NULL;
@@ -143,24 +610,21 @@ static unsigned int
 find_entryless(unsigned first, unsigned last)
 {
     unsigned a;
-    int i;
+    struct prefix key;
 
     for(a = first; a <= last; a++) {
-        for(i = 0; i < numentries; i++) {
-            if(entries[i].address == a)
-                break;
-        }
-        if(i >= numentries)
+        if(find_entry(address_key(a, &key)) == NULL)
             return a;
     }
     return 0;
 }
 
-struct lease_entry *
-find_oldest_entry()
+/* Kind is -1 for any kind of entry. */
+static struct lease_entry *
+find_oldest_entry(int kind, struct lease_pool *pool)
 {
     int i, j = -1;
-    unsigned age = 0, a;
+    time_t age = 0, a;
     struct timeval now;
 
     gettime(&now, NULL);
@@ -168,8 +632,13 @@ find_oldest_entry()
     for(i = 0; i < numentries; i++) {
         if(entries[i].id == NULL)
             continue;
+        if(kind >= 0 && key_kind(&entries[i].key) != kind)
+            continue;
+        if(pool && entries[i].pool != pool)
+            continue;
+        /* Negative for leases that are still running. */
         a = now.tv_sec - entries[i].lease_end_m;
-        if(a > age) {
+        if(j < 0 || a > age) {
             age = a;
             j = i;
         }
@@ -177,15 +646,49 @@ find_oldest_entry()
     return j >= 0 ? &entries[j] : NULL;
 }
 
+static void
+remove_entry(struct lease_entry *entry)
+{
+    account_entry(entry, -1);
+    pool_mark(entry->pool, &entry->key, 0);
+    unlink_id(entry);
+    free(entry->id);
+    entry->id = NULL;
+    entry->id_len = 0;
+    memset(&entry->key, 0, sizeof(entry->key));
+    entry->lease_orig = 0;
+    entry->lease_time = 0;
+    entry->lease_end_m = 0;
+    entry->pool = NULL;
+}
+
+/* Tell our replication peer about a lease that we committed. */
+static void
+replicate_entry(const struct lease_entry *entry)
+{
+    struct lease_update update;
+
+    if(entry == NULL || entry->id_len > MAX_UPDATE_ID)
+        return;
+
+    update.key = entry->key;
+    memcpy(update.id, entry->id, entry->id_len);
+    update.id_len = entry->id_len;
+    update.lease_orig = entry->lease_orig;
+    update.lease_time = entry->lease_time;
+    update.lease_end_m = entry->lease_end_m;
+    replicate_lease(&update);
+}
+
 static struct lease_entry *
-add_entry(const unsigned char *id, int id_len, unsigned int address,
+add_entry(const unsigned char *id, int id_len, const struct prefix *key,
           unsigned lease_orig, unsigned lease_time, time_t lease_end_m)
 {
     struct lease_entry *entry;
-    int i;
+    int i, *bucket;
 
     for(i = 0; i < numentries; i++) {
-        if(entries[i].address == address) {
+        if(key_eq(&entries[i].key, key)) {
             if(!entry_match(&entries[i], id, id_len))
                 return NULL;
             entry = &entries[i];
@@ -219,17 +722,10 @@ add_entry(const unsigned char *id, int id_len, unsigned int address,
     }
 
     if(entry == NULL) {
-        entry = find_oldest_entry();
+        entry = find_oldest_entry(-1, NULL);
         if(entry == NULL)
             return NULL;
-
-        free(entry->id);
-        entry->id = NULL;
-        entry->id_len = 0;
-        entry->address = 0;
-        entry->lease_orig = 0;
-        entry->lease_time = 0;
-        entry->lease_end_m = 0;
+        remove_entry(entry);
     }
 
     entry->id = malloc(id_len);
@@ -237,17 +733,52 @@ add_entry(const unsigned char *id, int id_len, unsigned int address,
         return NULL;
     memcpy(entry->id, id, id_len);
     entry->id_len = id_len;
-    entry->address = address;
+    bucket = id_bucket(id, id_len);
+    entry->next_id = *bucket;
+    *bucket = entry - entries;
+    entry->key = *key;
+    entry->pool = key_pool(key);
+    entry->state = -1;
+    pool_mark(entry->pool, &entry->key, 1);
 
  done:
     entry->lease_orig = lease_orig;
     entry->lease_time = lease_time;
     entry->lease_end_m = lease_end_m;
+    update_entry(entry);
     return entry;
 }
 
+/* Lease files for addresses are named after the address; lease files for
+   delegated prefixes are named address-plen. */
+
+static char *
+lease_name(const struct prefix *key, char *buf, int bufsize)
+{
+    const char *p;
+    int kind, n, rc;
+
+    kind = key_kind(key);
+    if(kind == IPv4_ADDRESS || kind == IPv4_PREFIX)
+        p = inet_ntop(AF_INET, key->p + 12, buf, bufsize);
+    else
+        p = inet_ntop(AF_INET6, key->p, buf, bufsize);
+    if(p == NULL)
+        return NULL;
+
+    if(kind == IPv4_PREFIX || kind == IPv6_PREFIX) {
+        n = strlen(buf);
+        rc = snprintf(buf + n, bufsize - n, "-%d",
+                      kind == IPv4_PREFIX ? key->plen - 96 : key->plen);
+        if(rc < 0 || rc >= bufsize - n)
+            return NULL;
+    }
+
+    return buf;
+}
+
 static char *
-lease_file(const unsigned char *ipv4, char *buf, int bufsize)
+lease_file(const struct prefix *key, char *buf, int bufsize)
 {
     const char *p;
     int n;
@@ -259,7 +790,7 @@ lease_file(const unsigned char *ipv4, char *buf, int bufsize)
     memcpy(buf, lease_directory, n);
     buf[n++] = '/';
 
-    p = inet_ntop(AF_INET, ipv4, buf + n, bufsize - n);
+    p = lease_name(key, buf + n, bufsize - n);
     if(p == NULL)
         return NULL;
 
@@ -290,74 +821,100 @@ close_lease_file(int fd, int modified)
     return rc;
 }
 
+/* Version 1 lease files hold an IPv4 address, and have a 20-byte header.
+   Version 2 lease files hold an IPv6 address or a prefix, and have
+   a 36-byte header. */
+
+static int
+lease_header_len(const struct prefix *key)
+{
+    return key_kind(key) == IPv4_ADDRESS ? 20 : 36;
+}
+
 static int
-read_lease_file(int fd, const unsigned char *ipv4,
+read_lease_file(int fd, const struct prefix *key,
                 unsigned *lease_orig_return, unsigned *lease_time_return,
-                unsigned char *ipv4_return,
+                struct prefix *key_return,
                 unsigned char *client_buf, int client_len)
 {
-    int rc, i;
-    struct iovec iov[2];
-    char head[20], name[INET_ADDRSTRLEN];
+    int rc, hlen;
+    unsigned char data[36 + 650];
+    struct prefix k;
     unsigned lease_orig, lease_time;
 
-    i = 0;
-    iov[i].iov_base = head;
-    iov[i++].iov_len = 20;
-    if(client_len > 0) {
-        iov[i].iov_base = client_buf;
-        iov[i++].iov_len = client_len;
-    }
-
-    rc = readv(fd, iov, i);
+    rc = read(fd, data, sizeof(data));
     if(rc < 0) {
         perror("read(lease_file)");
         return -1;
     }
 
-    if(rc < 20 || rc > 20 + client_len) {
-        fprintf(stderr, "Truncated lease file for %s.\n", name);
+    if(rc < 8) {
+        fprintf(stderr, "Truncated lease file.\n");
         return -1;
     }
 
-    if(memcmp("AHCP", head, 4) != 0) {
-        fprintf(stderr, "Corrupted lease file for %s.\n", name);
+    if(memcmp("AHCP", data, 4) != 0) {
+        fprintf(stderr, "Corrupted lease file.\n");
+        return -1;
+    }
+
+    if(memcmp("\1\0\0\0", data + 4, 4) == 0) {
+        hlen = 20;
+    } else if(memcmp("\2\0\0\0", data + 4, 4) == 0) {
+        hlen = 36;
+    } else {
+        fprintf(stderr, "Lease file has wrong version.\n");
         return -1;
     }
 
-    if(memcmp("\1\0\0\0", head + 4, 4) != 0) {
-        fprintf(stderr, "Lease file %s has wrong version.\n", name);
+    if(rc < hlen || (client_buf && rc > hlen + client_len)) {
+        fprintf(stderr, "Truncated lease file.\n");
         return -1;
     }
 
-    if(ipv4 && memcmp(ipv4, head + 8, 4) != 0) {
-        fprintf(stderr, "Mismatched lease file for %s.\n", name);
+    if(hlen == 20) {
+        ipv4_key(data + 8, &k);
+    } else {
+        memcpy(k.p, data + 8, 16);
+        k.plen = data[24];
+        if(k.plen == 0 || (k.plen > 128 && k.plen != 0xFF) ||
+           lease_header_len(&k) != 36) {
+            fprintf(stderr, "Corrupted lease file.\n");
+            return -1;
+        }
+    }
+
+    if(key && !key_eq(key, &k)) {
+        fprintf(stderr, "Mismatched lease file.\n");
         return -1;
     }
 
-    memcpy(&lease_orig, head + 12, 4);
+    memcpy(&lease_orig, data + hlen - 8, 4);
     lease_orig = ntohl(lease_orig);
 
-    memcpy(&lease_time, head + 16, 4);
+    memcpy(&lease_time, data + hlen - 4, 4);
     lease_time = ntohl(lease_time);
 
     if(lease_orig_return)
         *lease_orig_return = lease_orig;
     if(lease_time_return)
         *lease_time_return = lease_time;
-    if(ipv4_return)
-        memcpy(ipv4_return, head + 8, 4);
+    if(key_return)
+        *key_return = k;
+    if(client_buf && rc > hlen)
+        memcpy(client_buf, data + hlen, rc - hlen);
 
-    return rc - 20;
+    return rc - hlen;
 }
 
 static int
-write_lease_file(int fd, const unsigned char *ipv4,
+write_lease_file(int fd, const struct prefix *key,
                  unsigned lease_orig, unsigned lease_time,
                  const unsigned char *client_id, int client_len)
 {
-    struct iovec iov[5];
-    int i;
+    struct iovec iov[7];
+    unsigned char plen[4] = {0};
+    int i, hlen;
     int rc;
 
     if(client_len > 650)
@@ -366,11 +923,23 @@ write_lease_file(int fd, const unsigned char *ipv4,
     lease_orig = htonl(lease_orig);
     lease_time = htonl(lease_time);
 
+    hlen = lease_header_len(key);
+
     i = 0;
-    iov[i].iov_base = "AHCP\1\0\0\0";
-    iov[i++].iov_len = 8;
-    iov[i].iov_base = (void*)ipv4;
-    iov[i++].iov_len = 4;
+    if(hlen == 20) {
+        iov[i].iov_base = "AHCP\1\0\0\0";
+        iov[i++].iov_len = 8;
+        iov[i].iov_base = (void*)(key->p + 12);
+        iov[i++].iov_len = 4;
+    } else {
+        plen[0] = key->plen;
+        iov[i].iov_base = "AHCP\2\0\0\0";
+        iov[i++].iov_len = 8;
+        iov[i].iov_base = (void*)key->p;
+        iov[i++].iov_len = 16;
+        iov[i].iov_base = plen;
+        iov[i++].iov_len = 4;
+    }
     iov[i].iov_base = &lease_orig;
     iov[i++].iov_len = 4;
     iov[i].iov_base = &lease_time;
@@ -379,7 +948,7 @@ write_lease_file(int fd, const unsigned char *ipv4,
     iov[i++].iov_len = client_len;
 
     rc = writev(fd, iov, i);
-    if(rc < 20 + client_len) {
+    if(rc < hlen + client_len) {
         perror("write(lease_file)");
         return -1;
     }
@@ -388,7 +957,8 @@ write_lease_file(int fd, const unsigned char *ipv4,
 }
 
 static int
-update_lease_file(int fd, unsigned lease_orig, unsigned lease_time)
+update_lease_file(int fd, const struct prefix *key,
+                  unsigned lease_orig, unsigned lease_time)
 {
     off_t lrc;
     int rc, i;
@@ -397,7 +967,7 @@ update_lease_file(int fd, unsigned lease_orig, unsigned lease_time)
     lease_orig = htonl(lease_orig);
     lease_time = htonl(lease_time);
 
-    lrc = lseek(fd, 12, SEEK_SET);
+    lrc = lseek(fd, lease_header_len(key) - 8, SEEK_SET);
     if(lrc < 0) {
         perror("lseek(lease_file)");
         return -1;
@@ -421,7 +991,7 @@ update_lease_file(int fd, unsigned lease_orig, unsigned lease_time)
 /* Return 1 if the file was removed. */
 
 static int
-purge_lease_file(char *fn, unsigned char *ipv4)
+purge_lease_file(char *fn, const struct prefix *key)
 {
     int fd, rc;
     unsigned lease_orig, lease_time;
@@ -436,7 +1006,7 @@ purge_lease_file(char *fn, unsigned char *ipv4)
     if(fd < 0)
         return 0;
 
-    rc = read_lease_file(fd, ipv4, &lease_orig, &lease_time, NULL, NULL, 0);
+    rc = read_lease_file(fd, key, &lease_orig, &lease_time, NULL, NULL, 0);
     if(rc < 0) {
         close_lease_file(fd, 0);
         return 0;
@@ -457,7 +1027,7 @@ purge_lease_file(char *fn, unsigned char *ipv4)
 
 /* Make a relative lease absolute. */
 static int
-mutate_lease(char *fn, const unsigned char *ipv4, struct lease_entry *entry)
+mutate_lease(char *fn, const struct prefix *key, struct lease_entry *entry)
 {
     int fd;
     unsigned lease_orig, lease_time;
@@ -473,7 +1043,7 @@ mutate_lease(char *fn, const unsigned char *ipv4, struct lease_entry *entry)
     if(clock_status != CLOCK_TRUSTED)
         return -1;
 
-    if(entry && entry->address != ipv4_address(ipv4)) {
+    if(entry && !key_eq(&entry->key, key)) {
         fprintf(stderr, "Entry mismatch when mutating!\n");
         return -1;
     }
@@ -482,7 +1052,7 @@ mutate_lease(char *fn, const unsigned char *ipv4, struct lease_entry *entry)
     if(fd < 0)
         return 0;
 
-    rc = read_lease_file(fd, ipv4, &lease_orig, &lease_time, NULL, NULL, 0);
+    rc = read_lease_file(fd, key, &lease_orig, &lease_time, NULL, NULL, 0);
     if(rc < 0)
         goto fail;
 
@@ -499,7 +1069,7 @@ mutate_lease(char *fn, const unsigned char *ipv4, struct lease_entry *entry)
     else
         lease_orig = real.tv_sec;
 
-    rc = update_lease_file(fd, lease_orig, lease_time);
+    rc = update_lease_file(fd, key, lease_orig, lease_time);
     if(rc < 0)
         goto fail;
 
@@ -515,7 +1085,7 @@ mutate_lease(char *fn, const unsigned char *ipv4, struct lease_entry *entry)
 }
 
 static int
-lease_expired(const unsigned char *ipv4,
+lease_expired(const struct prefix *key,
               unsigned lease_orig, unsigned lease_time)
 {
     struct timeval now, real;
@@ -526,29 +1096,29 @@ lease_expired(const unsigned char *ipv4,
     get_real_time(&real, &clock_status);
 
     if(clock_status == CLOCK_TRUSTED && lease_orig > 0)
-        return lease_orig + LEASE_GRACE_TIME < real.tv_sec;
+        return lease_orig + lease_time + LEASE_GRACE_TIME < real.tv_sec;
 
     gettime(&now, &stable);
 
     if(stable < lease_time)
         return 0;
 
-    if(!ipv4)
+    if(!key)
         return 0;
 
-    entry = find_entry(ipv4_address(ipv4));
+    entry = find_entry(key);
     if(!entry)
         return 0;
 
-    return entry->lease_end_m + LEASE_GRACE_TIME > now.tv_sec;
+    return entry->lease_end_m + LEASE_GRACE_TIME < now.tv_sec;
 }
 
 static int
 get_lease(const unsigned char *client_id, int client_len,
-          const unsigned char *ipv4, unsigned lease_time,
+          const struct prefix *key, unsigned lease_time,
           int commit)
 {
-    unsigned char buf[512];
+    unsigned char buf[650];
     char fn[256], *p;
     int fd, rc;
     unsigned lease_orig, old_orig, old_time;
@@ -562,7 +1132,7 @@ get_lease(const unsigned char *client_id, int client_len,
     lease_orig = clock_status == CLOCK_TRUSTED ? real.tv_sec : 0;
     lease_end_m = now.tv_sec + lease_time;
 
-    p = lease_file(ipv4, fn, 256);
+    p = lease_file(key, fn, 256);
     if(p == NULL)
         return -1;
 
@@ -578,7 +1148,7 @@ get_lease(const unsigned char *client_id, int client_len,
         return -1;
     }
 
-    rc = read_lease_file(fd, ipv4, &old_orig, &old_time, NULL, buf, 512);
+    rc = read_lease_file(fd, key, &old_orig, &old_time, NULL, buf, 650);
     if(rc < 0) {
         fprintf(stderr, "Couldn't read lease file.\n");
         goto fail;
@@ -586,7 +1156,7 @@ get_lease(const unsigned char *client_id, int client_len,
 
     if(rc == client_len && memcmp(buf, client_id, client_len) == 0) {
         struct lease_entry *entry;
-        entry = find_entry(ipv4_address(ipv4));
+        entry = find_entry(key);
         if(!entry || !entry_match(entry, client_id, client_len)) {
             fprintf(stderr, "Eek!  Inconsistent lease entry!\n");
             goto fail;
@@ -598,15 +1168,17 @@ get_lease(const unsigned char *client_id, int client_len,
             lease_time = MAX(lease_time, entry->lease_end_m - now.tv_sec);
                            
         if(commit) {
-            rc = update_lease_file(fd, lease_orig, lease_time);
+            rc = update_lease_file(fd, key, lease_orig, lease_time);
             if(rc < 0)
                 goto fail;
             entry->lease_orig = lease_orig;
             entry->lease_time = lease_time;
             entry->lease_end_m = lease_end_m;
+            update_entry(entry);
+            replicate_entry(entry);
         }
     } else {
-        if(!lease_expired(ipv4, old_time, old_orig)) {
+        if(!lease_expired(key, old_orig, old_time)) {
             if(old_orig == 0 && clock_status == CLOCK_TRUSTED)
                 goto mutate;
             else
@@ -614,11 +1186,16 @@ get_lease(const unsigned char *client_id, int client_len,
         }
 
         if(commit) {
+            struct lease_entry *entry = find_entry(key);
             rc = unlink(fn);
             if(rc < 0) {
                 perror("unlink(lease_file)");
                 goto fail;
             }
+            /* Forget the previous owner, or add_entry will refuse the
+               new one. */
+            if(entry)
+                remove_entry(entry);
             close_lease_file(fd, 1);
             goto create;
         }
@@ -632,7 +1209,7 @@ get_lease(const unsigned char *client_id, int client_len,
 
  mutate:
     close_lease_file(fd, 0);
-    mutate_lease(fn, ipv4, find_entry(ipv4_address(ipv4)));
+    mutate_lease(fn, key, find_entry(key));
     return -1;
 
  create:
@@ -642,32 +1219,30 @@ get_lease(const unsigned char *client_id, int client_len,
         return -1;
     }
 
-    rc = write_lease_file(fd, ipv4, lease_orig, lease_time,
+    rc = write_lease_file(fd, key, lease_orig, lease_time,
                           client_id, client_len);
     if(rc < 0)
         goto fail;
 
-    add_entry(client_id, client_len, ipv4_address(ipv4),
-              lease_orig, lease_time, lease_end_m);
-
-    return close_lease_file(fd, 1);
+    rc = close_lease_file(fd, 1);
+    if(rc >= 0)
+        replicate_entry(add_entry(client_id, client_len, key,
+                                  lease_orig, lease_time, lease_end_m));
+    return rc;
 }
 
-int
-release_lease(const unsigned char *client_id, int client_len,
-              const unsigned char *ipv4)
+static int
+release_key(const unsigned char *client_id, int client_len,
+            const struct prefix *key)
 {
-    unsigned char buf[512];
+    unsigned char buf[650];
     char fn[256], *p;
     int fd, rc, clock_status;
     unsigned orig;
     struct timeval now, real;
     struct lease_entry *entry;
 
-    if(first_address == 0 || lease_directory == NULL)
-        return -1;
-
-    p = lease_file(ipv4, fn, 256);
+    p = lease_file(key, fn, 256);
     if(p == NULL)
         return -1;
 
@@ -677,7 +1252,7 @@ release_lease(const unsigned char *client_id, int client_len,
         return -1;
     }
 
-    rc = read_lease_file(fd, ipv4, NULL, NULL, NULL, buf, 512);
+    rc = read_lease_file(fd, key, NULL, NULL, NULL, buf, 650);
     if(rc < 0)
         goto fail;
 
@@ -694,7 +1269,7 @@ release_lease(const unsigned char *client_id, int client_len,
     else
         orig = 0;
 
-    rc = update_lease_file(fd, orig, 0);
+    rc = update_lease_file(fd, key, orig, 0);
     if(rc < 0) {
         rc = unlink(fn);
         if(rc < 0) {
@@ -706,10 +1281,14 @@ release_lease(const unsigned char *client_id, int client_len,
     if(rc < 0)
         goto fail;
 
-    entry = find_entry(ipv4_address(ipv4));
-    entry->lease_orig = orig;
-    entry->lease_time = 0;
-    entry->lease_end_m = now.tv_sec;
+    entry = find_entry(key);
+    if(entry) {
+        entry->lease_orig = orig;
+        entry->lease_time = 0;
+        entry->lease_end_m = now.tv_sec;
+        update_entry(entry);
+        replicate_entry(entry);
+    }
 
     return 1;
 
@@ -719,25 +1298,77 @@ release_lease(const unsigned char *client_id, int client_len,
 }
 
 int
-lease_init(const char *dir,
-           const unsigned char *first, const unsigned char *last, int debug)
+release_lease(const unsigned char *client_id, int client_len,
+              const unsigned char *ipv4)
 {
-    DIR *d;
-    struct timeval now, real;
-    int clock_status;
-    unsigned fa, la;
+    struct prefix key;
+
+    if(lease_directory == NULL)
+        return -1;
 
-    fa = ipv4_address(first);
-    la = ipv4_address(last);
+    return release_key(client_id, client_len, ipv4_key(ipv4, &key));
+}
 
-    if(fa <= 0x1000000 || fa >= la)
+/* Release all the delegated prefixes and IPv6 addresses held by a client,
+   since it doesn't tell us about them when releasing. */
+int
+release_client_leases(const unsigned char *client_id, int client_len)
+{
+    struct prefix key;
+    int i, rc, ret = 0;
+
+    if(lease_directory == NULL)
         return -1;
 
+    for(i = 0; i < numentries; i++) {
+        if(!entry_match(&entries[i], client_id, client_len) ||
+           key_kind(&entries[i].key) == IPv4_ADDRESS ||
+           entries[i].lease_time == 0)
+            continue;
+        key = entries[i].key;
+        rc = release_key(client_id, client_len, &key);
+        if(rc < 0)
+            ret = -1;
+        else if(ret == 0)
+            ret = 1;
+    }
+    return ret;
+}
+
+/* Whether a client holds a lease that has not expired yet, or is still
+   within its grace period. */
+int
+client_bound(const unsigned char *client_id, int client_len)
+{
+    struct timeval now;
+    int i;
+
+    gettime(&now, NULL);
+    i = *id_bucket(client_id, client_len);
+    while(i >= 0) {
+        if(entries[i].lease_time != 0 &&
+           entry_match(&entries[i], client_id, client_len) &&
+           entry_state(&entries[i], now.tv_sec) != LEASE_EXPIRED)
+            return 1;
+        i = entries[i].next_id;
+    }
+    return 0;
+}
+
+int
+lease_init(const char *dir, int debug)
+{
+    DIR *d;
+    struct timeval now, real;
+    int clock_status, i;
+
     entries = malloc(16 * sizeof(struct lease_entry));
     if(entries == NULL)
         return -1;
     numentries = 0;
     maxentries = 16;
+    for(i = 0; i < ID_BUCKETS; i++)
+        id_buckets[i] = -1;
 
     gettime(&now, NULL);
     get_real_time(&real, &clock_status);
@@ -750,10 +1381,11 @@ lease_init(const char *dir,
 
     while(1) {
         struct dirent *e;
-        unsigned char ipv4[4], client_buf[512];
-        char name[INET_ADDRSTRLEN], fn[256];
+        unsigned char client_buf[650];
+        char name[INET6_ADDRSTRLEN + 4], fn[256];
         const char *p;
         struct lease_entry *entry;
+        struct prefix key;
         unsigned lease_orig, lease_time;
         int fd, rc, len;
 
@@ -775,7 +1407,7 @@ lease_init(const char *dir,
             continue;
         }
         len = read_lease_file(fd, NULL, &lease_orig, &lease_time,
-                              ipv4, client_buf, 512);
+                              &key, client_buf, 650);
         close(fd);
 
         if(len < 0) {
@@ -783,7 +1415,7 @@ lease_init(const char *dir,
             continue;
         }
 
-        p = inet_ntop(AF_INET, ipv4, name, INET_ADDRSTRLEN);
+        p = lease_name(&key, name, INET6_ADDRSTRLEN + 4);
         if(p == NULL) {
             fprintf(stderr, "Couldn't format address.\n");
             continue;
@@ -800,18 +1432,18 @@ lease_init(const char *dir,
 
         if(clock_status == CLOCK_TRUSTED) {
             if(lease_expired(NULL, lease_orig, lease_time)) {
-                rc = purge_lease_file(fn, ipv4);
+                rc = purge_lease_file(fn, &key);
                 if(rc > 0)
                     continue;
             }
         }
 
-        entry = add_entry(client_buf, len, ipv4_address(ipv4),
+        entry = add_entry(client_buf, len, &key,
                           lease_orig, lease_time, now.tv_sec + lease_time);
 
         if(entry && clock_status == CLOCK_TRUSTED) {
             if(lease_orig == 0)
-                mutate_lease(fn, ipv4, entry);
+                mutate_lease(fn, &key, entry);
         }
     }
     closedir(d);
@@ -823,69 +1455,310 @@ lease_init(const char *dir,
     }
 
     lease_directory = dir;
-    first_address = fa;
-    last_address = la;
 
     return 1;
 }
 
+static int
+pool_overlap(const struct lease_pool *pool, const struct prefix *parent,
+             unsigned first, unsigned last)
+{
+    struct prefix key;
+    unsigned a;
+
+    if(pool->kind == IPv4_ADDRESS && parent == NULL)
+        return first <= pool->last && pool->first <= last;
+
+    if(pool->kind == IPv4_ADDRESS) {
+        if(memcmp(parent->p, v4prefix, 12) != 0)
+            return 0;
+        a = ipv4_address(parent->p + 12);
+        return prefix_within(address_key(pool->first, &key)->p, parent) ||
+            prefix_within(address_key(pool->last, &key)->p, parent) ||
+            (a >= pool->first && a <= pool->last);
+    }
+
+    if(parent == NULL) {
+        struct lease_pool range;
+        range.kind = IPv4_ADDRESS;
+        range.first = first;
+        range.last = last;
+        return pool_overlap(&range, &pool->parent, 0, 0);
+    }
+
+    return prefix_within(parent->p, &pool->parent) ||
+        prefix_within(pool->parent.p, parent);
+}
+
+/* Pools must be defined before lease_init, so that existing leases are
+   accounted for. */
+static struct lease_pool *
+add_pool(int kind, const struct prefix *parent,
+         unsigned first, unsigned last, int high_water)
+{
+    struct lease_pool *pool;
+    int i;
+
+    for(i = 0; i < numpools; i++) {
+        if(pool_overlap(&pools[i], parent, first, last))
+            return NULL;
+    }
+
+    if(numpools >= MAX_POOLS)
+        return NULL;
+
+    pool = &pools[numpools++];
+    memset(pool, 0, sizeof(struct lease_pool));
+    pool->kind = kind;
+    if(parent) {
+        pool->parent = *parent;
+        for(i = parent->plen; i < 128; i++)
+            pool->parent.p[i / 8] &= ~(0x80 >> (i % 8));
+    }
+    pool->first = first;
+    pool->last = last;
+    pool->high_water = high_water;
+    return pool;
+}
+
 int
-take_lease(const unsigned char *client_id, int client_len,
-           const unsigned char *suggested_ipv4,
-           unsigned char *ipv4_return, unsigned *lease_time, int commit)
+address_pool_init(const unsigned char *first, const unsigned char *last,
+                  int high_water)
+{
+    struct lease_pool *pool;
+    unsigned a = ipv4_address(first), b = ipv4_address(last);
+
+    if(a > b)
+        return -1;
+
+    pool = add_pool(IPv4_ADDRESS, NULL, a, b, high_water);
+    if(pool == NULL)
+        return -1;
+    pool->size = b - a + 1;
+    return 1;
+}
+
+int
+ipv6_pool_init(const struct prefix *prefix, int high_water)
+{
+    if(prefix->plen != 64 || memcmp(prefix->p, v4prefix, 12) == 0)
+        return -1;
+
+    return add_pool(IPv6_ADDRESS, prefix, 0, 0, high_water) ? 1 : -1;
+}
+
+int
+delegation_init(const struct prefix *parent, int plen, int high_water)
+{
+    struct lease_pool *pool;
+    int v4 = memcmp(parent->p, v4prefix, 12) == 0;
+
+    if(v4 && parent->plen < 96)
+        return -1;
+
+    if(plen <= parent->plen || plen > 128)
+        return -1;
+
+    pool = add_pool(v4 ? IPv4_PREFIX : IPv6_PREFIX, parent, 0, 0,
+                    high_water);
+    if(pool == NULL)
+        return -1;
+    pool->plen = plen;
+    if(plen - parent->plen < 32)
+        pool->size = 1U << (plen - parent->plen);
+    return 1;
+}
+
+/* Called periodically.  This is cheap unless some lease has changed
+   state since the last call. */
+void
+lease_check(void)
+{
+    struct timeval now;
+    int i;
+
+    gettime(&now, NULL);
+    if(next_transition == 0 || now.tv_sec < next_transition)
+        return;
+
+    next_transition = 0;
+    for(i = 0; i < numentries; i++) {
+        if(entries[i].id)
+            account_entry(&entries[i], entry_state(&entries[i], now.tv_sec));
+    }
+}
+
+void
+lease_dump(void)
+{
+    char name[100];
+    int i;
+
+    for(i = 0; i < numpools; i++) {
+        if(pool_name(&pools[i], name, 100) == NULL)
+            strcpy(name, "(unknown)");
+        printf("Pool %s: %u bound, %u reserved, %u expired",
+               name, pools[i].count[LEASE_BOUND],
+               pools[i].count[LEASE_RESERVED],
+               pools[i].count[LEASE_EXPIRED]);
+        if(pools[i].size > 0)
+            printf(", %u free", pool_free(&pools[i]));
+        printf("%s.\n", pools[i].alarm ? " (above high-water mark)" : "");
+    }
+}
+
+/* Iterate over the lease table, for sending it to a replication peer.
+   Returns 0 when done. */
+int
+lease_walk(int *cursor, struct lease_update *update)
 {
-    unsigned int a, a0;
-    unsigned time;
     struct lease_entry *entry;
-    unsigned char ipv4[4];
-    struct timeval now, real;
-    int clock_status;
-    time_t stable;
 
-    if(first_address == 0 || lease_directory == NULL)
+    while(*cursor < numentries) {
+        entry = &entries[(*cursor)++];
+        if(entry->id == NULL || entry->id_len > MAX_UPDATE_ID)
+            continue;
+        update->key = entry->key;
+        memcpy(update->id, entry->id, entry->id_len);
+        update->id_len = entry->id_len;
+        update->lease_orig = entry->lease_orig;
+        update->lease_time = entry->lease_time;
+        update->lease_end_m = entry->lease_end_m;
+        return 1;
+    }
+    return 0;
+}
+
+/* Store a lease committed by our replication peer.  Returns 0 if we
+   already have a more recent commit for this key. */
+int
+apply_lease(const struct lease_update *update, unsigned remaining)
+{
+    char fn[256], *p;
+    struct lease_entry *entry;
+    struct timeval now;
+    int fd, rc;
+
+    if(lease_directory == NULL || update->id_len < 1)
         return -1;
 
-    if(client_len < 1)
+    p = lease_file(&update->key, fn, 256);
+    if(p == NULL)
         return -1;
 
-    gettime(&now, &stable);
+    gettime(&now, NULL);
+
+    /* Don't let a stale update override a more recent commit. */
+    entry = find_entry(&update->key);
+    if(entry) {
+        if(update->lease_orig > 0 && entry->lease_orig > 0) {
+            if(update->lease_orig < entry->lease_orig)
+                return 0;
+        } else if(entry_match(entry, update->id, update->id_len) &&
+                  now.tv_sec + remaining < entry->lease_end_m) {
+            return 0;
+        }
+        if(!entry_match(entry, update->id, update->id_len))
+            remove_entry(entry);
+    }
+
+    fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        perror("open(lease_file)");
+        return -1;
+    }
+
+    rc = write_lease_file(fd, &update->key,
+                          update->lease_orig, update->lease_time,
+                          update->id, update->id_len);
+    if(rc < 0) {
+        close_lease_file(fd, 0);
+        unlink(fn);
+        return -1;
+    }
+
+    rc = close_lease_file(fd, 1);
+    if(rc < 0)
+        return -1;
+
+    entry = add_entry(update->id, update->id_len, &update->key,
+                      update->lease_orig, update->lease_time,
+                      now.tv_sec + remaining);
+    return entry ? 1 : -1;
+}
+
+static unsigned
+clamp_lease_time(unsigned time)
+{
+    int clock_status;
+    struct timeval real;
+
     get_real_time(&real, &clock_status);
 
-    time = *lease_time;
     if(time > MAX_LEASE_TIME)
         time = MAX_LEASE_TIME;
     if(clock_status != CLOCK_TRUSTED && time > MAX_RELATIVE_LEASE_TIME)
         time = MAX_RELATIVE_LEASE_TIME;
+    return time;
+}
+
+int
+take_lease(const unsigned char *client_id, int client_len,
+           const unsigned char *first, const unsigned char *last,
+           const unsigned char *suggested_ipv4,
+           unsigned char *ipv4_return, unsigned *lease_time, int commit)
+{
+    unsigned int a, a0, first_address, last_address;
+    unsigned time;
+    struct lease_entry *entry;
+    struct lease_pool *pool;
+    struct prefix key;
+
+    if(lease_directory == NULL)
+        return -1;
+
+    first_address = ipv4_address(first);
+    last_address = ipv4_address(last);
+
+    if(first_address <= 0x1000000 || first_address >= last_address)
+        return -1;
+
+    if(client_len < 1)
+        return -1;
+
+    pool = find_address_pool(first_address, last_address);
+    time = clamp_lease_time(*lease_time);
     a0 = 0;
 
     /* Client suggested an IP.  If it is in range, try that. */
     if(suggested_ipv4) {
         a0 = ipv4_address(suggested_ipv4);
-        entry = find_entry(a0);
+        entry = find_entry(ipv4_key(suggested_ipv4, &key));
         if(entry) {
             if(!entry_match(entry, client_id, client_len) &&
-               !lease_expired(suggested_ipv4,
-                              entry->lease_orig, entry->lease_time))
+               !lease_expired(&key, entry->lease_orig, entry->lease_time))
                 a0 = 0;
         }
     }
 
     /* See if we have an old lease for this client. */
     if(a0 < first_address || a0 > last_address) {
-        entry = find_entry_by_id(client_id, client_len);
+        entry = find_entry_by_id(client_id, client_len,
+                                 first_address, last_address);
         if(entry)
-            a0 = entry->address;
+            a0 = ipv4_address(entry->key.p + 12);
     }
 
-    /* Choose a free slot. */
-    if(a0 < first_address || a0 > last_address)
+    /* Choose a free slot, unless the counters say there is none. */
+    if((a0 < first_address || a0 > last_address) &&
+       (pool == NULL || pool_free(pool) > 0))
         a0 = find_entryless(first_address, last_address);
 
     /* Choose the oldest slot. */
     if(a0 < first_address || a0 > last_address) {
-        entry = find_oldest_entry();
+        entry = find_oldest_entry(IPv4_ADDRESS, pool);
         if(entry)
-            a0 = entry->address;
+            a0 = ipv4_address(entry->key.p + 12);
     }
 
     /* Give up, take the first one. */
@@ -897,20 +1770,150 @@ take_lease(const unsigned char *client_id, int client_len,
     do {
         int rc;
 
-        if(a > last_address)
-            a = first_address;
-
-        rc = get_lease(client_id, client_len, address_ipv4(a, ipv4),
+        rc = get_lease(client_id, client_len, address_key(a, &key),
                        time, commit);
         if(rc >= 0) {
-            memcpy(ipv4_return, ipv4, 4);
+            memcpy(ipv4_return, key.p + 12, 4);
             *lease_time = time;
             return 1;
         }
         a++;
+        if(a > last_address)
+            a = first_address;
     } while (a != a0);
 
     return -1;
 }
 
+int
+take_delegation(const unsigned char *client_id, int client_len,
+                const struct prefix *parent,
+                struct prefix *prefix_return, unsigned *lease_time,
+                int commit)
+{
+    struct lease_pool *pool = find_pool(parent);
+    struct lease_entry *entry;
+    struct prefix key;
+    unsigned time;
+    int i, rc;
+
+    if(pool == NULL || lease_directory == NULL)
+        return -1;
+
+    if(client_len < 1)
+        return -1;
+
+    time = clamp_lease_time(*lease_time);
+
+    /* See if we have an old delegation for this client. */
+    for(i = 0; i < numentries; i++) {
+        if(entry_match(&entries[i], client_id, client_len) &&
+           entries[i].pool == pool) {
+            key = entries[i].key;
+            rc = get_lease(client_id, client_len, &key, time, commit);
+            if(rc >= 0)
+                goto done;
+        }
+    }
+
+    /* Choose a free block. */
+    rc = pool_allocate(pool, &key);
+    if(rc >= 0) {
+        rc = get_lease(client_id, client_len, &key, time, commit);
+        if(rc >= 0)
+            goto done;
+    }
+
+    /* Choose the oldest block, which will only succeed if it's expired. */
+    entry = find_oldest_entry(-1, pool);
+    if(entry) {
+        key = entry->key;
+        rc = get_lease(client_id, client_len, &key, time, commit);
+        if(rc >= 0)
+            goto done;
+    }
+
+    return -1;
+
+ done:
+    *prefix_return = key;
+    *lease_time = time;
+    return 1;
+}
+
+/* Compute the nth candidate interface identifier for a client.  The
+   first candidate is the client's id itself, which is usually derived
+   from a MAC address; the following ones are hashes of it. */
+static void
+interface_id(const unsigned char *client_id, int client_len, int n,
+             unsigned char *iid)
+{
+    unsigned h;
+    int i;
+
+    if(n == 0 && client_len == 8) {
+        memcpy(iid, client_id, 8);
+        return;
+    }
+
+    h = 2166136261U ^ n;
+    for(i = 0; i < client_len + 8; i++) {
+        h = (h ^ (i < client_len ? client_id[i] : h >> 24)) * 16777619U;
+        if(i >= client_len)
+            iid[i - client_len] = h >> 24;
+    }
+    /* Clear the universal/local and group bits. */
+    iid[0] &= ~3;
+}
+
+int
+take_ipv6_lease(const unsigned char *client_id, int client_len,
+                const struct prefix *pool,
+                unsigned char *ipv6_return, unsigned *lease_time, int commit)
+{
+    struct prefix key;
+    unsigned time;
+    int i, rc;
+
+    if(lease_directory == NULL || pool->plen != 64)
+        return -1;
+
+    if(client_len < 1)
+        return -1;
+
+    time = clamp_lease_time(*lease_time);
+
+    /* See if we have an old lease for this client. */
+    for(i = 0; i < numentries; i++) {
+        if(entry_match(&entries[i], client_id, client_len) &&
+           key_kind(&entries[i].key) == IPv6_ADDRESS &&
+           prefix_within(entries[i].key.p, pool)) {
+            key = entries[i].key;
+            rc = get_lease(client_id, client_len, &key, time, commit);
+            if(rc >= 0)
+                goto done;
+        }
+    }
+
+    /* Try a few interface identifiers; get_lease will refuse any address
+       that is leased to somebody else. */
+    memcpy(key.p, pool->p, 8);
+    key.plen = 0xFF;
+    for(i = 0; i < IPv6_LEASE_PROBES; i++) {
+        interface_id(client_id, client_len, i, key.p + 8);
+        if(memcmp(key.p + 8, zeroes, 8) == 0)
+            continue;
+        rc = get_lease(client_id, client_len, &key, time, commit);
+        if(rc >= 0)
+            goto done;
+    }
+
+    return -1;
+
+ done:
+    memcpy(ipv6_return, key.p, 16);
+    *lease_time = time;
+    return 1;
+}
+
 #endif
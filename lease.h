@@ -23,12 +23,45 @@ THE SOFTWARE.
 #define MAX_LEASE_TIME (8 * 24 * 3600)
 #define MAX_RELATIVE_LEASE_TIME (4 * 3600 + 7)
 
-int lease_init(const char *dir,
-               const unsigned char *first, const unsigned char *last,
-               int debug);
+/* A lease as exchanged with a replication peer. */
+
+#define MAX_UPDATE_ID 64
+
+struct lease_update {
+    struct prefix key;
+    unsigned char id[MAX_UPDATE_ID];
+    int id_len;
+    unsigned lease_orig;
+    unsigned lease_time;
+    time_t lease_end_m;
+};
+
+extern const char *high_water_script;
+
+int lease_init(const char *dir, int debug);
 int take_lease(const unsigned char *client_id, int client_id_len,
+               const unsigned char *first, const unsigned char *last,
                const unsigned char *suggested_ipv4,
                unsigned char *ipv4_return, unsigned *lease_time,
                int commit);
 int release_lease(const unsigned char *client_id, int client_id_len,
                   const unsigned char *ipv4);
+int address_pool_init(const unsigned char *first, const unsigned char *last,
+                      int high_water);
+int ipv6_pool_init(const struct prefix *prefix, int high_water);
+int delegation_init(const struct prefix *parent, int plen, int high_water);
+int take_delegation(const unsigned char *client_id, int client_id_len,
+                    const struct prefix *parent,
+                    struct prefix *prefix_return, unsigned *lease_time,
+                    int commit);
+int take_ipv6_lease(const unsigned char *client_id, int client_id_len,
+                    const struct prefix *pool,
+                    unsigned char *ipv6_return, unsigned *lease_time,
+                    int commit);
+int release_client_leases(const unsigned char *client_id, int client_id_len);
+int client_bound(const unsigned char *client_id, int client_id_len);
+void lease_check(void);
+void run_high_water_script(int high, const char *name, const char *percent);
+void lease_dump(void);
+int lease_walk(int *cursor, struct lease_update *update);
+int apply_lease(const struct lease_update *update, unsigned remaining);
@@ -35,6 +35,7 @@ THE SOFTWARE.
 #include <time.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "monotonic.h"
 
@@ -62,6 +63,9 @@ time_t ntp_check_time = 0;
    monotonic time; previous is the previous real time. */
 static time_t offset, previous;
 
+/* The lease thread reads the clock too; this protects the state above. */
+static pthread_mutex_t clock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 #if defined(HAVE_ADJTIMEX)
 
 #include <sys/timex.h>
@@ -147,8 +151,8 @@ time_init()
     0: confirm that our time is broken.
     1: confirm that our time seems reasonable. */
 
-void
-time_confirm(int confirm)
+static void
+confirm_locked(int confirm)
 {
     struct timeval tv;
 
@@ -162,8 +166,17 @@ time_confirm(int confirm)
         clock_status = CLOCK_UNTRUSTED;
 }
 
-int
-get_real_time(struct timeval *tv, int *status_return)
+void
+time_confirm(int confirm)
+{
+    pthread_mutex_lock(&clock_mutex);
+    confirm_locked(confirm);
+    pthread_mutex_unlock(&clock_mutex);
+}
+
+/* Called with clock_mutex held. */
+static int
+real_time_locked(struct timeval *tv, int *status_return)
 {
     int rc;
     rc = gettimeofday(tv, NULL);
@@ -181,10 +194,22 @@ get_real_time(struct timeval *tv, int *status_return)
 }
 
 int
-gettime(struct timeval *tv, time_t *stable)
+get_real_time(struct timeval *tv, int *status_return)
 {
     int rc;
 
+    pthread_mutex_lock(&clock_mutex);
+    rc = real_time_locked(tv, status_return);
+    pthread_mutex_unlock(&clock_mutex);
+    return rc;
+}
+
+/* With CLOCK_MONOTONIC, this only takes the lock once an hour. */
+int
+gettime(struct timeval *tv, time_t *stable)
+{
+    int rc, locked = 0;
+
 #if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
     if(have_posix_clocks) {
         struct timespec ts;
@@ -202,19 +227,33 @@ gettime(struct timeval *tv, time_t *stable)
 #warning No CLOCK_MONOTONIC on this platform
 #endif
     {
-        rc = get_real_time(tv, NULL);
-        if(rc < 0)
+        pthread_mutex_lock(&clock_mutex);
+        locked = 1;
+        rc = real_time_locked(tv, NULL);
+        if(rc < 0) {
+            pthread_mutex_unlock(&clock_mutex);
             return rc;
+        }
         tv->tv_sec += offset;
     }
 
     if(stable)
         *stable = tv->tv_sec - clock_stable_time;
 
-    if(UNLIKELY(tv->tv_sec - ntp_check_time > 3600)) {
-        time_confirm(-1);
-        ntp_check_time = tv->tv_sec;
+    if(UNLIKELY(tv->tv_sec -
+                __atomic_load_n(&ntp_check_time, __ATOMIC_RELAXED) > 3600)) {
+        if(!locked) {
+            pthread_mutex_lock(&clock_mutex);
+            locked = 1;
+        }
+        /* The other thread may have got here first. */
+        if(tv->tv_sec - ntp_check_time > 3600) {
+            confirm_locked(-1);
+            __atomic_store_n(&ntp_check_time, tv->tv_sec, __ATOMIC_RELAXED);
+        }
     }
 
+    if(locked)
+        pthread_mutex_unlock(&clock_mutex);
     return rc;
 }
@@ -45,6 +45,17 @@ copy_prefix_list(struct prefix_list *l)
     return c;
 }
 
+struct prefix_list *
+single_prefix_list(const struct prefix *p)
+{
+    struct prefix_list *l = calloc(1, sizeof(struct prefix_list));
+    if(l == NULL)
+        return NULL;
+    l->n = 1;
+    l->l[0] = *p;
+    return l;
+}
+
 int
 prefix_list_eq(struct prefix_list *l1, struct prefix_list *l2)
 {
@@ -276,6 +287,21 @@ parse_prefix(char *address, int kind)
     return list;
 }
 
+/* Clear the bits of a prefix beyond its length. */
+void
+mask_prefix(struct prefix *p)
+{
+    int n = p->plen / 8, r = p->plen % 8;
+
+    if(p->plen >= 128)
+        return;
+    if(r != 0) {
+        p->p[n] &= (0xFF << (8 - r)) & 0xFF;
+        n++;
+    }
+    memset(p->p + n, 0, 16 - n);
+}
+
 struct prefix_list *
 cat_prefix_list(struct prefix_list *p1, struct prefix_list *p2)
 {
@@ -46,6 +46,7 @@ struct prefix_list {
 
 void free_prefix_list(struct prefix_list *l);
 struct prefix_list *copy_prefix_list(struct prefix_list *l);
+struct prefix_list *single_prefix_list(const struct prefix *p);
 int prefix_list_eq(struct prefix_list *l1, struct prefix_list *l2);
 int prefix_list_v4(struct prefix_list *l);
 void prefix_list_extract4(unsigned char *dest, struct prefix_list *p);
@@ -54,5 +55,6 @@ struct prefix_list *raw_prefix_list(const unsigned char *data, int len,
                                     int kind);
 char *format_prefix_list(struct prefix_list *p, int kind);
 struct prefix_list *parse_prefix(char *address, int kind);
+void mask_prefix(struct prefix *p);
 struct prefix_list *cat_prefix_list(struct prefix_list *p1,
                                     struct prefix_list *p2);
@@ -0,0 +1,639 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ahcpd.h"
+#include "monotonic.h"
+#include "prefix.h"
+#include "config.h"
+#include "lease.h"
+#include "replication.h"
+
+int replication_socket = -1;
+
+#ifdef NO_SERVER
+
+int
+replication_init(int role, const char *peer, int peer_port, int port)
+{
+    return -1;
+}
+
+void
+replicate_lease(const struct lease_update *update)
+{
+    return;
+}
+
+int
+replication_serving(void)
+{
+    return 1;
+}
+
+void
+replication_timeout(struct timeval *tv)
+{
+    return;
+}
+
+void
+replication_receive(void)
+{
+    return;
+}
+
+void
+replication_send(void)
+{
+    return;
+}
+
+void
+replication_dump(void)
+{
+    return;
+}
+
+#else
+
+/* A server sends the leases it commits to a single peer over UDP.  Updates
+   are numbered within an epoch, which is chosen at random whenever the
+   sender starts afresh.  The receiver acknowledges the last update that
+   it got in sequence, and the sender retransmits whatever remains
+   unacknowledged.  When the receiver has lost track of an epoch, or the
+   sender's window overflows, the sender resends its whole table.
+
+   Both peers replicate to each other, but only the primary answers
+   clients while both are alive.  A server that starts up doesn't answer
+   clients until it has received its peer's table, or the peer has been
+   silent for REPL_DEAD_TIME: its own lease files might be missing leases
+   that the peer gave out in the meantime.  Hellos carry a count of 1
+   while the sender is still queueing its table. */
+
+#define REPL_DATA 1
+#define REPL_ACK 2
+#define REPL_HELLO 3
+
+#define REPL_HEADER_LEN 16
+#define REPL_RECORD_LEN 32
+#define REPL_MTU 1400
+#define REPL_WINDOW 512
+
+/* In milliseconds. */
+#define REPL_BATCH_DELAY 50
+#define REPL_RETRANSMIT_TIME 1000
+#define REPL_HELLO_TIME 3000
+#define REPL_DEAD_TIME 10000
+
+static int role = REPLICATION_NONE;
+static struct sockaddr_in6 peer;
+
+/* Updates from acked + 1 to next_seqno - 1 are in the window; those up
+   to sent have been sent at least once. */
+static struct lease_update queue[REPL_WINDOW];
+static unsigned epoch, acked, sent, next_seqno;
+static int syncing = 0, resync = 0, sync_cursor = 0;
+
+/* The last update received in sequence from the peer. */
+static unsigned peer_epoch = 0, peer_seqno = 0;
+static int peer_alive = 0;
+
+/* Whether we have caught up with the peer since we started. */
+static int synced = 0;
+
+static struct timeval flush_time, retransmit_time, hello_time, peer_time;
+static struct timeval sync_time;
+
+static void
+schedule_flush(void)
+{
+    struct timeval now;
+
+    if(next_seqno - 1 > sent && flush_time.tv_sec == 0) {
+        gettime(&now, NULL);
+        timeval_plus_msec(&flush_time, &now, REPL_BATCH_DELAY);
+    }
+}
+
+/* Queue as much of the lease table as fits in the window. */
+static void
+fill_window(void)
+{
+    int rc;
+
+    while(syncing && next_seqno - 1 - acked < REPL_WINDOW) {
+        rc = lease_walk(&sync_cursor, &queue[next_seqno % REPL_WINDOW]);
+        if(rc > 0) {
+            next_seqno++;
+        } else if(resync) {
+            resync = 0;
+            sync_cursor = 0;
+        } else {
+            syncing = 0;
+        }
+    }
+    schedule_flush();
+}
+
+static void
+start_epoch(void)
+{
+    do {
+        epoch = random();
+    } while(epoch == 0);
+    acked = sent = 0;
+    next_seqno = 1;
+    syncing = 1;
+    resync = 0;
+    sync_cursor = 0;
+    retransmit_time.tv_sec = 0;
+    debugf(1, "Starting replication epoch %u.\n", epoch);
+    fill_window();
+}
+
+void
+replicate_lease(const struct lease_update *update)
+{
+    if(replication_socket < 0)
+        return;
+
+    if(next_seqno - 1 - acked >= REPL_WINDOW) {
+        /* The peer is lagging; the table holds this update, and we will
+           send all of it again once the peer catches up. */
+        if(syncing) {
+            resync = 1;
+        } else {
+            syncing = 1;
+            sync_cursor = 0;
+        }
+        return;
+    }
+
+    queue[next_seqno % REPL_WINDOW] = *update;
+    next_seqno++;
+    schedule_flush();
+}
+
+static void
+format_header(unsigned char *buf, int type, int count,
+              unsigned e, unsigned seqno)
+{
+    unsigned short c = htons(count);
+
+    e = htonl(e);
+    seqno = htonl(seqno);
+    memcpy(buf, "AHRP", 4);
+    buf[4] = 1;
+    buf[5] = type;
+    memcpy(buf + 6, &c, 2);
+    memcpy(buf + 8, &e, 4);
+    memcpy(buf + 12, &seqno, 4);
+}
+
+static int
+format_record(unsigned char *buf, const struct lease_update *update,
+              time_t now)
+{
+    unsigned orig, time, remaining;
+    unsigned short id_len;
+
+    orig = htonl(update->lease_orig);
+    time = htonl(update->lease_time);
+    remaining =
+        htonl(update->lease_end_m > now ? update->lease_end_m - now : 0);
+    id_len = htons(update->id_len);
+
+    memcpy(buf, update->key.p, 16);
+    buf[16] = update->key.plen;
+    buf[17] = 0;
+    memcpy(buf + 18, &id_len, 2);
+    memcpy(buf + 20, &orig, 4);
+    memcpy(buf + 24, &time, 4);
+    memcpy(buf + 28, &remaining, 4);
+    memcpy(buf + 32, update->id, update->id_len);
+    return REPL_RECORD_LEN + update->id_len;
+}
+
+static int
+send_message(const unsigned char *buf, int len)
+{
+    int rc;
+
+    rc = send(replication_socket, buf, len, 0);
+    /* ECONNREFUSED just means that the peer isn't running. */
+    if(rc < 0 && errno != EAGAIN && errno != ECONNREFUSED)
+        perror("send(replication)");
+    return rc;
+}
+
+static void
+send_control(int type, int count, unsigned e, unsigned seqno)
+{
+    unsigned char buf[REPL_HEADER_LEN];
+
+    format_header(buf, type, count, e, seqno);
+    send_message(buf, REPL_HEADER_LEN);
+}
+
+/* Send one batch of updates, starting after sent. */
+static int
+send_data(void)
+{
+    unsigned char buf[REPL_MTU];
+    struct lease_update *update;
+    struct timeval now;
+    unsigned seqno = sent + 1;
+    int len = REPL_HEADER_LEN, count = 0, rc;
+
+    gettime(&now, NULL);
+
+    while(seqno < next_seqno) {
+        update = &queue[seqno % REPL_WINDOW];
+        if(len + REPL_RECORD_LEN + update->id_len > REPL_MTU)
+            break;
+        len += format_record(buf + len, update, now.tv_sec);
+        seqno++;
+        count++;
+    }
+
+    if(count == 0)
+        return 0;
+
+    format_header(buf, REPL_DATA, count, epoch, sent + 1);
+    rc = send_message(buf, len);
+    if(rc < 0)
+        return -1;
+
+    sent = seqno - 1;
+    timeval_plus_msec(&retransmit_time, &now, REPL_RETRANSMIT_TIME);
+    return count;
+}
+
+static void
+heard_peer(void)
+{
+    gettime(&peer_time, NULL);
+    if(!peer_alive) {
+        peer_alive = 1;
+        fprintf(stderr, "Replication peer is up%s.\n",
+                role == REPLICATION_SECONDARY ? ", standing by" : "");
+    }
+}
+
+static void
+handle_data(unsigned e, unsigned seqno, int count,
+            const unsigned char *buf, int len)
+{
+    struct lease_update update;
+    unsigned remaining;
+    unsigned short id_len;
+    int i, p, rc;
+
+    if(e != peer_epoch) {
+        if(seqno != 1) {
+            /* We don't know what came before, ask for everything. */
+            send_control(REPL_ACK, 0, e, 0);
+            return;
+        }
+        debugf(1, "Replication peer started epoch %u.\n", e);
+        peer_epoch = e;
+        peer_seqno = 0;
+    }
+
+    p = REPL_HEADER_LEN;
+    for(i = 0; i < count; i++, seqno++) {
+        if(p + REPL_RECORD_LEN > len)
+            break;
+        memcpy(&id_len, buf + p + 18, 2);
+        id_len = ntohs(id_len);
+        if(id_len < 1 || id_len > MAX_UPDATE_ID ||
+           p + REPL_RECORD_LEN + id_len > len)
+            break;
+
+        if(seqno == peer_seqno + 1) {
+            memcpy(update.key.p, buf + p, 16);
+            update.key.plen = buf[p + 16];
+            memcpy(&update.lease_orig, buf + p + 20, 4);
+            update.lease_orig = ntohl(update.lease_orig);
+            memcpy(&update.lease_time, buf + p + 24, 4);
+            update.lease_time = ntohl(update.lease_time);
+            memcpy(&remaining, buf + p + 28, 4);
+            remaining = ntohl(remaining);
+            memcpy(update.id, buf + p + REPL_RECORD_LEN, id_len);
+            update.id_len = id_len;
+
+            if(update.key.plen == 0 ||
+               (update.key.plen > 128 && update.key.plen != 0xFF)) {
+                fprintf(stderr, "Corrupted replicated lease.\n");
+            } else {
+                rc = apply_lease(&update, MIN(remaining, MAX_LEASE_TIME));
+                if(rc < 0)
+                    fprintf(stderr, "Couldn't apply replicated lease.\n");
+            }
+            /* Retransmission won't help with a local failure. */
+            peer_seqno = seqno;
+        } else if(seqno > peer_seqno + 1) {
+            break;
+        }
+        p += REPL_RECORD_LEN + id_len;
+    }
+
+    send_control(REPL_ACK, 0, peer_epoch, peer_seqno);
+}
+
+static void
+handle_ack(unsigned e, unsigned seqno)
+{
+    if(e != epoch || seqno >= next_seqno)
+        return;
+
+    if(seqno == 0 && acked > 0) {
+        fprintf(stderr, "Replication peer lost state, resynchronising.\n");
+        start_epoch();
+        return;
+    }
+
+    if(seqno > acked) {
+        acked = seqno;
+        if(sent < acked)
+            sent = acked;
+        if(sent == acked) {
+            retransmit_time.tv_sec = 0;
+        } else {
+            gettime(&retransmit_time, NULL);
+            timeval_plus_msec(&retransmit_time, &retransmit_time,
+                              REPL_RETRANSMIT_TIME);
+        }
+        fill_window();
+    }
+}
+
+static void
+handle_hello(unsigned e, unsigned seqno, int count)
+{
+    if(e != peer_epoch) {
+        if(seqno != 1) {
+            send_control(REPL_ACK, 0, e, 0);
+            return;
+        }
+        peer_epoch = e;
+        peer_seqno = 0;
+    }
+
+    /* Let the peer know if we are missing anything. */
+    if(seqno - 1 > peer_seqno)
+        send_control(REPL_ACK, 0, peer_epoch, peer_seqno);
+    else if(count == 0 && !synced) {
+        synced = 1;
+        fprintf(stderr, "Synchronised with replication peer.\n");
+    }
+}
+
+void
+replication_receive(void)
+{
+    unsigned char buf[REPL_MTU];
+    struct sockaddr_in6 sin6;
+    socklen_t sinlen = sizeof(sin6);
+    unsigned short count;
+    unsigned e, seqno;
+    int len;
+
+    len = recvfrom(replication_socket, buf, REPL_MTU, 0,
+                   (struct sockaddr*)&sin6, &sinlen);
+    if(len < 0) {
+        if(errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+            perror("recv(replication)");
+        return;
+    }
+
+    if(memcmp(&sin6.sin6_addr, &peer.sin6_addr, 16) != 0 ||
+       sin6.sin6_port != peer.sin6_port) {
+        debugf(1, "Replication message from unknown peer.\n");
+        return;
+    }
+
+    if(len < REPL_HEADER_LEN || memcmp(buf, "AHRP", 4) != 0 || buf[4] != 1) {
+        fprintf(stderr, "Corrupted replication message.\n");
+        return;
+    }
+
+    memcpy(&count, buf + 6, 2);
+    count = ntohs(count);
+    memcpy(&e, buf + 8, 4);
+    e = ntohl(e);
+    memcpy(&seqno, buf + 12, 4);
+    seqno = ntohl(seqno);
+
+    heard_peer();
+
+    switch(buf[5]) {
+    case REPL_DATA: handle_data(e, seqno, count, buf, len); break;
+    case REPL_ACK: handle_ack(e, seqno); break;
+    case REPL_HELLO: handle_hello(e, seqno, count); break;
+    default: debugf(1, "Unknown replication message %d.\n", buf[5]);
+    }
+}
+
+void
+replication_send(void)
+{
+    struct timeval now;
+    int rc;
+
+    if(replication_socket < 0)
+        return;
+
+    gettime(&now, NULL);
+
+    if(peer_alive &&
+       timeval_minus_msec(&now, &peer_time) >= REPL_DEAD_TIME) {
+        peer_alive = 0;
+        fprintf(stderr, "Replication peer is silent%s.\n",
+                role == REPLICATION_SECONDARY ? ", taking over" : "");
+    }
+
+    /* A peer that is alive will finish sending its table eventually. */
+    if(!synced && !peer_alive && timeval_compare(&sync_time, &now) <= 0) {
+        synced = 1;
+        fprintf(stderr, "No replication peer, serving from our own leases.\n");
+    }
+
+    /* Don't bother retransmitting to a dead peer, it will tell us where
+       it's at when it comes back. */
+    if(peer_alive && sent > acked && retransmit_time.tv_sec > 0 &&
+       timeval_compare(&retransmit_time, &now) <= 0) {
+        debugf(2, "Retransmitting replication updates after %u.\n", acked);
+        sent = acked;
+        flush_time = now;
+    }
+
+    if(flush_time.tv_sec > 0 && timeval_compare(&flush_time, &now) <= 0) {
+        while(next_seqno - 1 > sent) {
+            rc = send_data();
+            if(rc <= 0)
+                break;
+        }
+        flush_time.tv_sec = 0;
+        flush_time.tv_usec = 0;
+    }
+
+    if(hello_time.tv_sec == 0 || timeval_compare(&hello_time, &now) <= 0) {
+        send_control(REPL_HELLO, syncing, epoch, next_seqno);
+        timeval_plus_msec(&hello_time, &now, roughly(REPL_HELLO_TIME));
+    }
+}
+
+void
+replication_timeout(struct timeval *tv)
+{
+    struct timeval t;
+
+    if(replication_socket < 0)
+        return;
+
+    timeval_min(tv, &flush_time);
+    timeval_min(tv, &hello_time);
+    if(!synced)
+        timeval_min(tv, &sync_time);
+    if(peer_alive) {
+        if(sent > acked)
+            timeval_min(tv, &retransmit_time);
+        timeval_plus_msec(&t, &peer_time, REPL_DEAD_TIME);
+        timeval_min(tv, &t);
+    }
+}
+
+int
+replication_serving(void)
+{
+    if(replication_socket >= 0 && !synced)
+        return 0;
+    return role != REPLICATION_SECONDARY || !peer_alive;
+}
+
+void
+replication_dump(void)
+{
+    char a[INET6_ADDRSTRLEN];
+
+    if(replication_socket < 0)
+        return;
+
+    inet_ntop(AF_INET6, &peer.sin6_addr, a, INET6_ADDRSTRLEN);
+    printf("Replicating to %s (%s%s), epoch %u: "
+           "%u queued, %u unacknowledged%s.\n",
+           a, peer_alive ? "up" : "silent",
+           replication_serving() ? ", serving" : "",
+           epoch, next_seqno - 1 - sent, sent - acked,
+           syncing ? ", synchronising" : "");
+}
+
+int
+replication_init(int r, const char *address, int peer_port, int port)
+{
+    struct sockaddr_in6 sin6;
+    unsigned char ipv4[4];
+    int s, rc, saved_errno;
+    int one = 1, zero = 0;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sin6_family = AF_INET6;
+    peer.sin6_port = htons(peer_port);
+    rc = inet_pton(AF_INET6, address, &peer.sin6_addr);
+    if(rc <= 0) {
+        rc = inet_pton(AF_INET, address, ipv4);
+        if(rc <= 0)
+            return -1;
+        memcpy(&peer.sin6_addr, v4prefix, 12);
+        memcpy((unsigned char*)&peer.sin6_addr + 12, ipv4, 4);
+    }
+
+    s = socket(PF_INET6, SOCK_DGRAM, 0);
+    if(s < 0)
+        return -1;
+
+    rc = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(rc < 0)
+        perror("setsockopt(SO_REUSEADDR)");
+
+#ifdef IPV6_V6ONLY
+    rc = setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    if(rc < 0)
+        perror("setsockopt(IPV6_V6ONLY)");
+#endif
+
+    rc = fcntl(s, F_GETFD, 0);
+    if(rc < 0)
+        goto fail;
+
+    rc = fcntl(s, F_SETFD, rc | FD_CLOEXEC);
+    if(rc < 0)
+        goto fail;
+
+    rc = fcntl(s, F_GETFL, 0);
+    if(rc < 0)
+        goto fail;
+
+    rc = fcntl(s, F_SETFL, (rc | O_NONBLOCK));
+    if(rc < 0)
+        goto fail;
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_port = htons(port);
+    rc = bind(s, (struct sockaddr*)&sin6, sizeof(sin6));
+    if(rc < 0)
+        goto fail;
+
+    /* Have the kernel drop datagrams from anyone else. */
+    rc = connect(s, (struct sockaddr*)&peer, sizeof(peer));
+    if(rc < 0)
+        goto fail;
+
+    replication_socket = s;
+    role = r;
+    gettime(&sync_time, NULL);
+    timeval_plus_msec(&sync_time, &sync_time, REPL_DEAD_TIME);
+    start_epoch();
+    return 1;
+
+ fail:
+    saved_errno = errno;
+    close(s);
+    errno = saved_errno;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+
+#include "ring.h"
+
+/* Returns 0 if the ring is full. */
+int
+ring_put(struct ring *ring, void *p)
+{
+    unsigned tail = ring->tail;
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(tail - head >= RING_SIZE)
+        return 0;
+
+    ring->slots[tail % RING_SIZE] = p;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Returns NULL if the ring is empty. */
+void *
+ring_get(struct ring *ring)
+{
+    unsigned head = ring->head;
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    void *p;
+
+    if(head == tail)
+        return NULL;
+
+    p = ring->slots[head % RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* The number of items waiting.  Called by the consumer. */
+int
+ring_count(struct ring *ring)
+{
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return tail - ring->head;
+}
+
+/* Called by the producer. */
+int
+ring_space(struct ring *ring)
+{
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return RING_SIZE - (ring->tail - head);
+}
@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Checks that captures read back what was written. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+
+#include "../capture.h"
+#include "check.h"
+
+static void
+record(struct capture_record *rec, int n, int ifindex)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->time.tv_sec = 1000 + n;
+    rec->time.tv_usec = 999999 - n;
+    rec->ifindex = ifindex;
+    rec->domain = n % 2;
+    rec->from.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, n % 2 ? "fe80::1" : "2001:db8::1",
+              &rec->from.sin6_addr);
+    rec->from.sin6_port = htons(5359 + n);
+    inet_pton(AF_INET6, "ff02::cca6:c0f9:e182:5359", &rec->dst);
+    rec->len = n * 100;
+}
+
+static void
+test_round_trip(const char *filename)
+{
+    struct capture_record rec, back;
+    unsigned char buf[1500], got[1500];
+    int lo = if_nametoindex("lo");
+    int i, rc;
+
+    for(i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = i * 7;
+
+    rc = capture_open(filename);
+    CHECK(rc > 0);
+    for(i = 0; i < 4; i++) {
+        /* Record 3 is on an interface that doesn't exist. */
+        record(&rec, i, i < 3 ? lo : 0);
+        rc = capture_write(&rec, buf);
+        CHECK(rc > 0);
+    }
+    capture_close();
+
+    rc = replay_open(filename);
+    CHECK(rc > 0);
+    for(i = 0; i < 4; i++) {
+        record(&rec, i, i < 3 ? lo : 0);
+        rc = replay_read(&back, got, sizeof(got));
+        CHECK(rc == 1);
+        if(rc != 1)
+            return;
+        CHECK(back.time.tv_sec == rec.time.tv_sec &&
+              back.time.tv_usec == rec.time.tv_usec);
+        CHECK(back.ifindex == rec.ifindex);
+        CHECK(back.domain == rec.domain);
+        CHECK(memcmp(&back.from.sin6_addr, &rec.from.sin6_addr, 16) == 0);
+        CHECK(back.from.sin6_port == rec.from.sin6_port);
+        CHECK(back.from.sin6_scope_id ==
+              (IN6_IS_ADDR_LINKLOCAL(&rec.from.sin6_addr) ? rec.ifindex : 0));
+        CHECK(memcmp(&back.dst, &rec.dst, 16) == 0);
+        CHECK(back.len == rec.len);
+        CHECK(memcmp(got, buf, rec.len) == 0);
+    }
+    rc = replay_read(&back, got, sizeof(got));
+    CHECK(rc == 0);
+}
+
+static void
+test_bad_magic(const char *filename)
+{
+    FILE *f;
+    int rc;
+
+    f = fopen(filename, "w");
+    if(f == NULL) {
+        CHECK(f != NULL);
+        return;
+    }
+    fputs("AHCPCAP0 and some junk", f);
+    fclose(f);
+
+    rc = replay_open(filename);
+    CHECK(rc < 0 && errno == EINVAL);
+}
+
+int
+main(int argc, char **argv)
+{
+    char filename[] = "/tmp/ahcpd-capture-test.XXXXXX";
+    int fd;
+
+    fd = mkstemp(filename);
+    if(fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    test_round_trip(filename);
+    test_bad_magic(filename);
+    unlink(filename);
+
+    return CHECK_RESULT("capture-test");
+}
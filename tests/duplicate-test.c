@@ -0,0 +1,141 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Checks duplicate suppression as the time slots of the duplicate table
+   are reused. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "../ahcpd.h"
+#include "../transport.h"
+#include "check.h"
+
+/* What transport.c needs from the rest of the daemon. */
+
+int debug = 0;
+unsigned char myid[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+struct domain domains[MAXDOMAINS];
+int numnetworks = 0;
+struct network networks[MAXNETWORKS];
+struct timeval now;
+const unsigned char zeroes[16] = {0};
+const unsigned char ones[16] =
+    {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+const unsigned char v4prefix[16] =
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0 };
+
+void
+do_debugf(int level, const char *format, ...)
+{
+    return;
+}
+
+void
+timeval_min(struct timeval *d, const struct timeval *s)
+{
+    return;
+}
+
+int
+timeval_minus_msec(const struct timeval *s1, const struct timeval *s2)
+{
+    return 0;
+}
+
+int
+timeval_compare(const struct timeval *s1, const struct timeval *s2)
+{
+    return 0;
+}
+
+#define START 1000
+
+/* Receive packet n at time t.  Returns 0 if it was suppressed.  Packets
+   have a single hop left, so they are never forwarded. */
+static int
+receive(int n, time_t t)
+{
+    unsigned char buf[24];
+
+    buf[0] = 43;
+    buf[1] = 1;
+    buf[2] = 1;
+    buf[3] = 1;
+    memcpy(buf + 4, &n, 4);
+    memset(buf + 8, 0, 8);
+    buf[8] = 0x42;
+    buf[15] = n % 7;
+    memset(buf + 16, 0xFF, 8);
+
+    now.tv_sec = t;
+    now.tv_usec = 0;
+    return handle_packet(0, -1, 0, 0, NULL, buf, 24);
+}
+
+static void
+test_rollover(void)
+{
+    static const int ages[] =
+        {0, 1, 9, 10, 11, DUPLICATE_TIME - 1, DUPLICATE_TIME};
+    time_t t;
+    int i;
+
+    /* One new packet a second, for several rounds of slots; every packet
+       seen within the last DUPLICATE_TIME seconds is still known. */
+    for(t = START; t < START + 4 * DUPLICATE_TIME; t++) {
+        CHECK(receive(t, t) != 0);
+        for(i = 0; i < (int)(sizeof(ages) / sizeof(ages[0])); i++) {
+            if(t - ages[i] >= START)
+                CHECK(receive(t - ages[i], t) == 0);
+        }
+    }
+
+    /* Older packets are new again. */
+    t = START + 4 * DUPLICATE_TIME;
+    CHECK(receive(t - DUPLICATE_TIME - 1, t) != 0);
+    CHECK(receive(t - DUPLICATE_TIME - 1, t) == 0);
+
+    /* A burst at the very end of a slot is still known a window later. */
+    t = START + 10 * DUPLICATE_TIME - 1;
+    for(i = 0; i < 100; i++)
+        CHECK(receive(100000 + i, t) != 0);
+    for(i = 0; i < 100; i++)
+        CHECK(receive(200000 + i, t + 1) != 0);
+    for(i = 0; i < 100; i++) {
+        CHECK(receive(100000 + i, t + DUPLICATE_TIME) == 0);
+        CHECK(receive(200000 + i, t + DUPLICATE_TIME) == 0);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    test_rollover();
+
+    return CHECK_RESULT("duplicate-test");
+}
@@ -0,0 +1,505 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Checks for the lease allocator, run against a scratch lease directory. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../ahcpd.h"
+#include "../monotonic.h"
+#include "../prefix.h"
+#include "../lease.h"
+#include "../replication.h"
+#include "../event.h"
+
+/* What lease.c needs from the rest of the daemon. */
+
+int debug = 0;
+const unsigned char zeroes[16] = {0};
+const unsigned char v4prefix[16] =
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0 };
+
+void
+do_debugf(int level, const char *format, ...)
+{
+    return;
+}
+
+void
+event_child(void)
+{
+    return;
+}
+
+void
+replicate_lease(const struct lease_update *update)
+{
+    return;
+}
+
+/* A clock the tests can move forward; it is always trusted. */
+
+static time_t skew = 0;
+
+void
+time_init(void)
+{
+    return;
+}
+
+void
+time_confirm(int confirm)
+{
+    return;
+}
+
+int
+get_real_time(struct timeval *tv, int *status_return)
+{
+    tv->tv_sec = 1300000000 + skew;
+    tv->tv_usec = 0;
+    if(status_return)
+        *status_return = CLOCK_TRUSTED;
+    return 0;
+}
+
+int
+gettime(struct timeval *tv, time_t *stable)
+{
+    tv->tv_sec = 100000 + skew;
+    tv->tv_usec = 0;
+    if(stable)
+        *stable = tv->tv_sec;
+    return 0;
+}
+
+/* The number of high-water alarms, and the last one. */
+static int alarms = 0, alarm_high = -1;
+static char alarm_name[100], alarm_percent[12];
+
+void
+high_water_alarm(int high, const char *name, const char *percent)
+{
+    alarms++;
+    alarm_high = high;
+    snprintf(alarm_name, 100, "%s", name);
+    snprintf(alarm_percent, 12, "%s", percent);
+}
+
+#ifndef NO_SERVER
+
+#include "check.h"
+
+static void
+client(unsigned char *id, int n)
+{
+    memset(id, 0, 8);
+    id[0] = 0x42;
+    id[7] = n;
+}
+
+static void
+make_prefix(struct prefix *p, const char *address, int plen)
+{
+    memset(p, 0, sizeof(*p));
+    inet_pton(AF_INET6, address, p->p);
+    p->plen = plen;
+}
+
+/* Write a version 2 lease file the way an earlier run would have. */
+static int
+write_lease(const char *dir, const struct prefix *key,
+            unsigned lease_orig, unsigned lease_time, int n)
+{
+    char name[INET6_ADDRSTRLEN], fn[512];
+    unsigned char buf[36 + 8];
+    FILE *f;
+    int rc;
+
+    inet_ntop(AF_INET6, key->p, name, INET6_ADDRSTRLEN);
+    if(key->plen == 0xFF)
+        snprintf(fn, 512, "%s/%s", dir, name);
+    else
+        snprintf(fn, 512, "%s/%s-%d", dir, name, key->plen);
+
+    memcpy(buf, "AHCP\2\0\0\0", 8);
+    memcpy(buf + 8, key->p, 16);
+    memset(buf + 24, 0, 4);
+    buf[24] = key->plen;
+    lease_orig = htonl(lease_orig);
+    lease_time = htonl(lease_time);
+    memcpy(buf + 28, &lease_orig, 4);
+    memcpy(buf + 32, &lease_time, 4);
+    client(buf + 36, n);
+
+    f = fopen(fn, "w");
+    if(f == NULL)
+        return -1;
+    rc = fwrite(buf, 1, sizeof(buf), f);
+    fclose(f);
+    return rc == sizeof(buf) ? 1 : -1;
+}
+
+static void
+test_addresses(void)
+{
+    unsigned char first[4] = {192, 168, 4, 1}, last[4] = {192, 168, 4, 3};
+    unsigned char id[8], a[3][4], b[4];
+    unsigned time;
+    int i, rc;
+
+    high_water_script = "high-water";
+    rc = address_pool_init(first, last, 50);
+    CHECK(rc >= 0);
+
+    for(i = 0; i < 3; i++) {
+        client(id, i);
+        time = 3600;
+        rc = take_lease(id, 8, first, last, NULL, a[i], &time, 1);
+        CHECK(rc >= 0);
+        CHECK(memcmp(a[i], first, 3) == 0);
+        CHECK(a[i][3] >= 1 && a[i][3] <= 3);
+        CHECK(time > 0 && time <= 3600);
+    }
+    CHECK(memcmp(a[0], a[1], 4) != 0 && memcmp(a[0], a[2], 4) != 0 &&
+          memcmp(a[1], a[2], 4) != 0);
+    CHECK(alarms == 1);
+
+    /* The pool is full. */
+    client(id, 3);
+    time = 3600;
+    rc = take_lease(id, 8, first, last, NULL, b, &time, 1);
+    CHECK(rc < 0);
+
+    /* A client gets its lease back. */
+    client(id, 1);
+    time = 3600;
+    rc = take_lease(id, 8, first, last, NULL, b, &time, 1);
+    CHECK(rc >= 0 && memcmp(b, a[1], 4) == 0);
+    CHECK(client_bound(id, 8));
+
+    /* A released address stays reserved for its client. */
+    rc = release_lease(id, 8, a[1]);
+    CHECK(rc >= 0);
+    client(id, 3);
+    time = 3600;
+    rc = take_lease(id, 8, first, last, NULL, b, &time, 1);
+    CHECK(rc < 0);
+    client(id, 1);
+    time = 3600;
+    rc = take_lease(id, 8, first, last, NULL, b, &time, 1);
+    CHECK(rc >= 0 && memcmp(b, a[1], 4) == 0);
+}
+
+static void
+test_delegation(void)
+{
+    struct prefix parent, p[2];
+    unsigned char id[8];
+    unsigned time;
+    int i, rc;
+
+    make_prefix(&parent, "2001:db8::", 48);
+
+    rc = delegation_init(&parent, 56, 0);
+    CHECK(rc >= 0);
+
+    for(i = 0; i < 2; i++) {
+        client(id, 10 + i);
+        time = 3600;
+        rc = take_delegation(id, 8, &parent, &p[i], &time, 1);
+        CHECK(rc >= 0);
+        CHECK(p[i].plen == 56);
+        CHECK(memcmp(p[i].p, parent.p, 6) == 0);
+        CHECK(memcmp(p[i].p + 7, zeroes, 9) == 0);
+    }
+    CHECK(p[0].p[6] != p[1].p[6]);
+
+    /* Asking again gives the same prefix. */
+    client(id, 10);
+    time = 3600;
+    rc = take_delegation(id, 8, &parent, &p[1], &time, 1);
+    CHECK(rc >= 0 && memcmp(p[0].p, p[1].p, 16) == 0);
+}
+
+static void
+test_expiry(void)
+{
+    struct prefix parent, p[2], q;
+    unsigned char id[8];
+    unsigned time;
+    int i, rc;
+
+    make_prefix(&parent, "2001:db8:1::", 55);
+
+    rc = delegation_init(&parent, 56, 0);
+    CHECK(rc >= 0);
+
+    for(i = 0; i < 2; i++) {
+        client(id, 20 + i);
+        time = 600;
+        rc = take_delegation(id, 8, &parent, &p[i], &time, 1);
+        CHECK(rc >= 0);
+    }
+
+    /* Both blocks are taken. */
+    client(id, 22);
+    time = 600;
+    rc = take_delegation(id, 8, &parent, &q, &time, 1);
+    CHECK(rc < 0);
+
+    /* Once they expire, a new client gets one of them... */
+    skew += 3600;
+    rc = take_delegation(id, 8, &parent, &q, &time, 1);
+    CHECK(rc >= 0);
+    CHECK(memcmp(q.p, p[0].p, 16) == 0 || memcmp(q.p, p[1].p, 16) == 0);
+    CHECK(client_bound(id, 8));
+
+    /* ... and keeps it when it renews. */
+    time = 600;
+    rc = take_delegation(id, 8, &parent, &p[0], &time, 1);
+    CHECK(rc >= 0 && memcmp(p[0].p, q.p, 16) == 0);
+
+    /* A previous owner gets the other block, after which the pool is
+       full again. */
+    client(id, 20);
+    time = 600;
+    rc = take_delegation(id, 8, &parent, &p[1], &time, 1);
+    CHECK(rc >= 0 && memcmp(p[1].p, q.p, 16) != 0);
+    client(id, 21);
+    CHECK(!client_bound(id, 8));
+    time = 600;
+    rc = take_delegation(id, 8, &parent, &q, &time, 1);
+    CHECK(rc < 0);
+}
+
+/* Leases left by an earlier run; their pools must exist before
+   lease_init reads them. */
+static void
+setup_reload(const char *dir)
+{
+    struct prefix parent, pool, key;
+    int rc;
+
+    make_prefix(&parent, "2001:db8:2::", 55);
+    rc = delegation_init(&parent, 56, 0);
+    CHECK(rc >= 0);
+    make_prefix(&pool, "2001:db8:3::", 64);
+    rc = ipv6_pool_init(&pool, 0);
+    CHECK(rc >= 0);
+
+    make_prefix(&key, "2001:db8:2:100::", 56);
+    rc = write_lease(dir, &key, 1300000000 - 100, 3600, 30);
+    CHECK(rc >= 0);
+    /* Expired a day ago, but not purged yet. */
+    make_prefix(&key, "2001:db8:2::", 56);
+    rc = write_lease(dir, &key, 1300000000 - 90000, 3600, 31);
+    CHECK(rc >= 0);
+    make_prefix(&key, "2001:db8:3::1234", 0xFF);
+    rc = write_lease(dir, &key, 1300000000 - 100, 3600, 32);
+    CHECK(rc >= 0);
+}
+
+static void
+test_reload(void)
+{
+    struct prefix parent, pool, p, q;
+    unsigned char id[8], a[16], b[16];
+    unsigned time;
+    int rc;
+
+    make_prefix(&parent, "2001:db8:2::", 55);
+    make_prefix(&pool, "2001:db8:3::", 64);
+
+    /* Clients get their leases back. */
+    client(id, 30);
+    CHECK(client_bound(id, 8));
+    time = 3600;
+    rc = take_delegation(id, 8, &parent, &p, &time, 1);
+    make_prefix(&q, "2001:db8:2:100::", 56);
+    CHECK(rc >= 0 && memcmp(p.p, q.p, 16) == 0 && p.plen == 56);
+
+    client(id, 32);
+    time = 3600;
+    rc = take_ipv6_lease(id, 8, &pool, a, &time, 1);
+    inet_pton(AF_INET6, "2001:db8:3::1234", b);
+    CHECK(rc >= 0 && memcmp(a, b, 16) == 0);
+
+    /* The expired block is taken by a new client, after which the pool
+       is full. */
+    client(id, 33);
+    time = 3600;
+    rc = take_delegation(id, 8, &parent, &p, &time, 1);
+    make_prefix(&q, "2001:db8:2::", 56);
+    CHECK(rc >= 0 && memcmp(p.p, q.p, 16) == 0);
+    client(id, 34);
+    time = 3600;
+    rc = take_delegation(id, 8, &parent, &p, &time, 1);
+    CHECK(rc < 0);
+}
+
+static void
+test_ipv6(void)
+{
+    struct prefix pool;
+    unsigned char id[8], a[2][16], b[16];
+    unsigned time;
+    int i, rc;
+
+    make_prefix(&pool, "2001:db8:4::", 48);
+    rc = ipv6_pool_init(&pool, 0);
+    CHECK(rc < 0);
+
+    make_prefix(&pool, "2001:db8:4::", 64);
+    rc = ipv6_pool_init(&pool, 0);
+    CHECK(rc >= 0);
+
+    for(i = 0; i < 2; i++) {
+        client(id, 40 + i);
+        time = 3600;
+        rc = take_ipv6_lease(id, 8, &pool, a[i], &time, 1);
+        CHECK(rc >= 0);
+        CHECK(memcmp(a[i], pool.p, 8) == 0);
+        CHECK(memcmp(a[i] + 8, zeroes, 8) != 0);
+        CHECK(client_bound(id, 8));
+    }
+    CHECK(memcmp(a[0], a[1], 16) != 0);
+
+    /* Asking again gives the same address. */
+    client(id, 40);
+    time = 3600;
+    rc = take_ipv6_lease(id, 8, &pool, b, &time, 1);
+    CHECK(rc >= 0 && memcmp(a[0], b, 16) == 0);
+}
+
+static void
+test_high_water(void)
+{
+    struct prefix parent, p;
+    unsigned char id[8];
+    unsigned time;
+    int i, rc, n;
+
+    /* Let every earlier lease expire, so that only this pool moves. */
+    skew += 10000;
+    lease_check();
+    n = alarms;
+
+    make_prefix(&parent, "2001:db8:5::", 54);
+    rc = delegation_init(&parent, 56, 50);
+    CHECK(rc >= 0);
+
+    for(i = 0; i < 2; i++) {
+        client(id, 50 + i);
+        time = 600;
+        rc = take_delegation(id, 8, &parent, &p, &time, 1);
+        CHECK(rc >= 0);
+    }
+    CHECK(alarms == n + 1 && alarm_high == 1);
+    CHECK(strcmp(alarm_name, "2001:db8:5::-54") == 0);
+    CHECK(strcmp(alarm_percent, "50") == 0);
+
+    /* Reserved leases still count as used... */
+    skew += 600;
+    lease_check();
+    CHECK(alarms == n + 1);
+
+    /* ... expired ones don't. */
+    skew += 700;
+    lease_check();
+    CHECK(alarms == n + 2 && alarm_high == 0);
+
+    /* Two new clients get the free blocks, a third one an expired
+       block. */
+    for(i = 0; i < 3; i++) {
+        client(id, 52 + i);
+        time = 600;
+        rc = take_delegation(id, 8, &parent, &p, &time, 1);
+        CHECK(rc >= 0);
+    }
+    CHECK(alarms == n + 3 && alarm_high == 1);
+    CHECK(strcmp(alarm_percent, "50") == 0);
+}
+
+static void
+remove_directory(const char *dir)
+{
+    DIR *d;
+    struct dirent *e;
+    char fn[512];
+
+    d = opendir(dir);
+    if(d == NULL)
+        return;
+    while((e = readdir(d)) != NULL) {
+        if(e->d_name[0] == '.')
+            continue;
+        snprintf(fn, 512, "%s/%s", dir, e->d_name);
+        unlink(fn);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+#endif
+
+int
+main(int argc, char **argv)
+{
+#ifdef NO_SERVER
+    printf("lease-test: skipped, no server support.\n");
+    return 0;
+#else
+    char dir[] = "/tmp/ahcpd-lease-test.XXXXXX";
+    int rc;
+
+    if(mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    setup_reload(dir);
+
+    rc = lease_init(dir, 0);
+    CHECK(rc >= 0);
+    if(rc >= 0) {
+        test_reload();
+        test_addresses();
+        test_delegation();
+        test_expiry();
+        test_ipv6();
+        test_high_water();
+    }
+
+    remove_directory(dir);
+
+    return CHECK_RESULT("lease-test");
+#endif
+}
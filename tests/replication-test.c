@@ -0,0 +1,408 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Runs a primary and a secondary server on the loopback interface, and
+   checks that they end up with the same leases, including across a
+   restart of the primary while the secondary was serving. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../protocol.h"
+
+#define PRIMARY_PORT 5399
+#define SECONDARY_PORT 5398
+
+#ifndef NO_SERVER
+
+#include "check.h"
+
+static char dir[] = "/tmp/ahcpd-replication-test.XXXXXX";
+
+/* The address that each client was given, by the last byte of its id. */
+static unsigned char addresses[256][4];
+
+static int
+write_config(const char *name, const char *role, int peer_port, int port)
+{
+    char fn[256];
+    FILE *f;
+
+    snprintf(fn, 256, "%s/%s.conf", dir, name);
+    f = fopen(fn, "w");
+    if(f == NULL)
+        return -1;
+    fprintf(f, "mode server\nprefix 192.168.4.0/24\n");
+    fprintf(f, "lease-dir %s/%s\n", dir, name);
+    fprintf(f, "replication %s\n", role);
+    fprintf(f, "replication-peer ::1 %d\nreplication-port %d\n",
+            peer_port, port);
+    fclose(f);
+
+    snprintf(fn, 256, "%s/%s", dir, name);
+    return mkdir(fn, 0700);
+}
+
+static pid_t
+start_server(const char *name, int port)
+{
+    char conf[256], id[256], pid_file[256], log[256], p[10];
+    pid_t pid;
+    int fd;
+
+    snprintf(conf, 256, "%s/%s.conf", dir, name);
+    snprintf(id, 256, "%s/%s.id", dir, name);
+    snprintf(pid_file, 256, "%s/%s.pid", dir, name);
+    snprintf(log, 256, "%s/%s.log", dir, name);
+    snprintf(p, 10, "%d", port);
+
+    pid = fork();
+    if(pid != 0)
+        return pid;
+
+    fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd >= 0) {
+        dup2(fd, 1);
+        dup2(fd, 2);
+        close(fd);
+    }
+    execl("./ahcpd", "ahcpd", "-p", p, "-c", conf, "-i", id,
+          "-I", pid_file, "lo", (char*)NULL);
+    perror("exec(ahcpd)");
+    _exit(1);
+}
+
+static void
+stop_server(pid_t pid)
+{
+    if(pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/* Find the first IPv4 address in an ACK. */
+static int
+reply_address(const unsigned char *buf, int len, unsigned char *address)
+{
+    const unsigned char *body = buf + 28;
+    int i = 0, bodylen;
+
+    if(len < 28)
+        return -1;
+    bodylen = (buf[26] << 8) | buf[27];
+    if(bodylen > len - 28)
+        return -1;
+
+    while(i < bodylen) {
+        if(body[i] == OPT_PAD || body[i] == OPT_MANDATORY) {
+            i++;
+            continue;
+        }
+        if(i + 2 > bodylen || i + 2 + body[i + 1] > bodylen)
+            return -1;
+        if(body[i] == OPT_IPv4_ADDRESS && body[i + 1] >= 4) {
+            memcpy(address, body + i + 2, 4);
+            return 1;
+        }
+        i += 2 + body[i + 1];
+    }
+    return -1;
+}
+
+/* Have clients first to first + count - 1 request an address, retrying
+   once a second.  Returns the number of clients that got one. */
+static int
+request(int port, int first, int count, int tries)
+{
+    unsigned char buf[1500], acked[256] = {0};
+    struct sockaddr_in6 sin6;
+    struct timeval tv;
+    int s, i, n = 0, rc;
+
+    s = socket(PF_INET6, SOCK_DGRAM, 0);
+    if(s < 0) {
+        perror("socket");
+        return -1;
+    }
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    sin6.sin6_addr = in6addr_loopback;
+    sin6.sin6_port = htons(port);
+
+    while(n < count && tries-- > 0) {
+        for(i = first; i < first + count; i++) {
+            if(acked[i])
+                continue;
+            buf[0] = 43;
+            buf[1] = 1;
+            buf[2] = 1;
+            buf[3] = 1;
+            rc = random();
+            memcpy(buf + 4, &rc, 4);
+            memset(buf + 8, 0, 8);
+            buf[8] = 0x42;
+            buf[15] = i;
+            memset(buf + 16, 0xFF, 8);
+            buf[24] = AHCP_REQUEST;
+            buf[25] = 0;
+            buf[26] = 0;
+            buf[27] = 2;
+            buf[28] = OPT_IPv4_ADDRESS;
+            buf[29] = OPT_PAD;
+            sendto(s, buf, 30, 0, (struct sockaddr*)&sin6, sizeof(sin6));
+        }
+        while(1) {
+            rc = recv(s, buf, sizeof(buf), 0);
+            if(rc < 0)
+                break;
+            if(rc < 25 || buf[24] != AHCP_ACK || buf[16] != 0x42)
+                continue;
+            i = buf[23];
+            if(i >= first && i < first + count && !acked[i] &&
+               reply_address(buf, rc, addresses[i]) > 0) {
+                acked[i] = 1;
+                n++;
+            }
+        }
+    }
+    close(s);
+    return n;
+}
+
+static int
+count_leases(const char *name)
+{
+    char fn[256];
+    DIR *d;
+    struct dirent *e;
+    int n = 0;
+
+    snprintf(fn, 256, "%s/%s", dir, name);
+    d = opendir(fn);
+    if(d == NULL)
+        return -1;
+    while((e = readdir(d)) != NULL) {
+        if(e->d_name[0] != '.')
+            n++;
+    }
+    closedir(d);
+    return n;
+}
+
+/* Wait for both servers to hold n leases. */
+static int
+wait_leases(int n)
+{
+    int i;
+
+    for(i = 0; i < 50; i++) {
+        if(count_leases("primary") == n && count_leases("secondary") == n)
+            return 1;
+        usleep(100000);
+    }
+    return 0;
+}
+
+static int
+read_file(const char *fn, unsigned char *buf, int len)
+{
+    int fd, rc;
+
+    fd = open(fn, O_RDONLY);
+    if(fd < 0)
+        return -1;
+    rc = read(fd, buf, len);
+    close(fd);
+    return rc;
+}
+
+/* Returns the number of clients among the first n that were given the
+   same address as an earlier one. */
+static int
+shared_addresses(int n)
+{
+    int i, j, shared = 0;
+
+    for(i = 1; i <= n; i++) {
+        for(j = 1; j < i; j++) {
+            if(memcmp(addresses[i], addresses[j], 4) == 0) {
+                fprintf(stderr, "Clients %d and %d share an address.\n",
+                        j, i);
+                shared++;
+                break;
+            }
+        }
+    }
+    return shared;
+}
+
+/* Returns the number of leases that differ between the servers. */
+static int
+compare_leases(void)
+{
+    char fn[512];
+    unsigned char a[1024], b[1024];
+    DIR *d;
+    struct dirent *e;
+    int n = 0, rc1, rc2;
+
+    snprintf(fn, 512, "%s/primary", dir);
+    d = opendir(fn);
+    if(d == NULL)
+        return -1;
+    while((e = readdir(d)) != NULL) {
+        if(e->d_name[0] == '.')
+            continue;
+        snprintf(fn, 512, "%s/primary/%s", dir, e->d_name);
+        rc1 = read_file(fn, a, 1024);
+        snprintf(fn, 512, "%s/secondary/%s", dir, e->d_name);
+        rc2 = read_file(fn, b, 1024);
+        if(rc1 < 0 || rc1 != rc2 || memcmp(a, b, rc1) != 0) {
+            fprintf(stderr, "Lease %s differs.\n", e->d_name);
+            n++;
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+static void
+remove_directory(const char *name)
+{
+    char fn[512];
+    DIR *d;
+    struct dirent *e;
+
+    snprintf(fn, 512, "%s/%s", dir, name);
+    d = opendir(fn);
+    if(d == NULL)
+        return;
+    while((e = readdir(d)) != NULL) {
+        if(e->d_name[0] == '.')
+            continue;
+        snprintf(fn, 512, "%s/%s/%s", dir, name, e->d_name);
+        unlink(fn);
+    }
+    closedir(d);
+    snprintf(fn, 512, "%s/%s", dir, name);
+    rmdir(fn);
+}
+
+static void
+print_log(const char *name)
+{
+    char fn[256], line[256];
+    FILE *f;
+
+    snprintf(fn, 256, "%s/%s.log", dir, name);
+    f = fopen(fn, "r");
+    if(f == NULL)
+        return;
+    while(fgets(line, 256, f))
+        fprintf(stderr, "%s: %s", name, line);
+    fclose(f);
+}
+
+#endif
+
+int
+main(int argc, char **argv)
+{
+#ifdef NO_SERVER
+    printf("replication-test: skipped, no server support.\n");
+    return 0;
+#else
+    pid_t primary, secondary;
+    int rc;
+
+    srandom(getpid());
+
+    if(mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    rc = write_config("primary", "primary", 7002, 7001);
+    CHECK(rc >= 0);
+    rc = write_config("secondary", "secondary", 7001, 7002);
+    CHECK(rc >= 0);
+    if(failures > 0)
+        goto done;
+
+    primary = start_server("primary", PRIMARY_PORT);
+    secondary = start_server("secondary", SECONDARY_PORT);
+
+    /* The primary serves, and its leases reach the secondary. */
+    rc = request(PRIMARY_PORT, 1, 10, 5);
+    CHECK(rc == 10);
+    CHECK(wait_leases(10));
+
+    /* The secondary takes over once the primary is gone. */
+    stop_server(primary);
+    rc = request(SECONDARY_PORT, 11, 10, 20);
+    CHECK(rc == 10);
+
+    /* A restarted primary doesn't serve until it has heard from the
+       secondary, which gave out leases that it doesn't know about. */
+    kill(secondary, SIGSTOP);
+    primary = start_server("primary", PRIMARY_PORT);
+    rc = request(PRIMARY_PORT, 21, 10, 2);
+    CHECK(rc == 0);
+    kill(secondary, SIGCONT);
+    rc = request(PRIMARY_PORT, 21, 10, 10);
+    CHECK(rc == 10);
+    CHECK(shared_addresses(30) == 0);
+    CHECK(wait_leases(30));
+    CHECK(compare_leases() == 0);
+
+    stop_server(primary);
+    stop_server(secondary);
+
+ done:
+    if(failures > 0) {
+        print_log("primary");
+        print_log("secondary");
+    }
+
+    remove_directory("primary");
+    remove_directory("secondary");
+    remove_directory("");
+
+    return CHECK_RESULT("replication-test");
+#endif
+}
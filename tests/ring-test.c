@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2008, 2009 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Checks for the lock-free ring used by the lease thread. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "../ring.h"
+#include "check.h"
+
+#define COUNT 1000000
+
+static struct ring ring;
+
+static void
+test_sequential(void)
+{
+    uintptr_t i;
+    int full = 0, order = 1;
+
+    CHECK(ring_get(&ring) == NULL);
+    CHECK(ring_space(&ring) == RING_SIZE);
+    CHECK(ring_count(&ring) == 0);
+
+    /* Go round a few times. */
+    for(i = 1; i <= 3 * RING_SIZE + 7; i++) {
+        if(!ring_put(&ring, (void*)i))
+            full++;
+        if(ring_get(&ring) != (void*)i)
+            order = 0;
+    }
+    CHECK(full == 0);
+    CHECK(order);
+
+    for(i = 1; i <= RING_SIZE; i++)
+        CHECK(ring_put(&ring, (void*)i));
+    CHECK(!ring_put(&ring, (void*)i));
+    CHECK(ring_space(&ring) == 0);
+    CHECK(ring_count(&ring) == RING_SIZE);
+
+    for(i = 1; i <= RING_SIZE; i++) {
+        if(ring_get(&ring) != (void*)i)
+            order = 0;
+    }
+    CHECK(order);
+    CHECK(ring_get(&ring) == NULL);
+    CHECK(ring_count(&ring) == 0);
+}
+
+static void *
+producer(void *arg)
+{
+    uintptr_t i = 1;
+
+    while(i <= COUNT) {
+        if(ring_put(&ring, (void*)i))
+            i++;
+    }
+    return NULL;
+}
+
+/* One thread on each side, as with the lease thread. */
+static void
+test_threads(void)
+{
+    pthread_t thread;
+    uintptr_t expected = 1;
+    void *p;
+    int rc, order = 1;
+
+    rc = pthread_create(&thread, NULL, producer, NULL);
+    CHECK(rc == 0);
+    if(rc != 0)
+        return;
+
+    while(expected <= COUNT) {
+        p = ring_get(&ring);
+        if(p == NULL)
+            continue;
+        /* Keep draining, or the producer would never finish. */
+        if(p != (void*)expected)
+            order = 0;
+        expected = (uintptr_t)p + 1;
+    }
+    CHECK(order);
+    pthread_join(thread, NULL);
+    CHECK(ring_get(&ring) == NULL);
+}
+
+int
+main(int argc, char **argv)
+{
+    test_sequential();
+    test_threads();
+
+    return CHECK_RESULT("ring-test");
+}
@@ -20,6 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#define _GNU_SOURCE 1
+
+#if defined(__linux__)
+#define HAVE_SENDMMSG
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -35,33 +41,199 @@ THE SOFTWARE.
 #include "ahcpd.h"
 #include "monotonic.h"
 #include "transport.h"
+#include "protocol.h"
+#include "prefix.h"
+#include "config.h"
 
 unsigned myseqno;
 
-#define NUMDUPLICATE 64
+/* If non-zero, a packet waiting to be forwarded is dropped once we have
+   overheard this many copies of it from our neighbours. */
+int flood_threshold = 0;
+
+/* Zero if we only handle packets addressed to us. */
+int forwarding = 1;
+
+/* Zero if another process forwards the packets we receive by multicast,
+   which every process sharing the port gets a copy of. */
+int forward_multicast = 1;
+
+/* In relay mode, client messages are unicast to these servers rather
+   than flooded. */
+static struct sockaddr_in6 relays[MAX_RELAYS];
+static int numrelays = 0;
+
+/* Recently seen packets are kept in a hash table keyed on the domain and
+   the nonce, source and destination, which are contiguous in the header.
+   The table doubles whenever it has more entries than buckets, so that
+   its size follows the packet rate.  Entries are also chained into one
+   list per DUPLICATE_SLOT seconds of arrival time, and a whole list is
+   expired at once when its slot is reused.
+
+   The table is bounded: MAX_DUPLICATES entries are enough for a steady
+   2000 distinct packets per second over DUPLICATE_TIME, and take about
+   20MB.  Beyond that rate, the oldest slot is expired early, and a
+   packet seen less than DUPLICATE_TIME ago may then be taken for a new
+   one and forwarded again.  We prefer that to unbounded memory use
+   during a flood. */
+
+#define DUPLICATE_SLOT 10
+#define DUPLICATE_SLOTS (DUPLICATE_TIME / DUPLICATE_SLOT + 1)
+#define MIN_DUPLICATE_BUCKETS 64
+#define MAX_DUPLICATE_BUCKETS (1 << 18)
+#define MAX_DUPLICATES MAX_DUPLICATE_BUCKETS
 
 struct duplicate {
+    int domain;
+    unsigned char id[20];
+    unsigned hash;
+    time_t time;
+    struct queued_packet *forward;      /* our pending retransmission */
+    struct duplicate *next;     /* in the same bucket */
+    struct duplicate *next_slot;
+};
+
+struct duplicate_slot {
+    time_t start;
+    struct duplicate *first;
+};
+
+static struct duplicate **duplicates = NULL;
+static unsigned numbuckets = 0, numduplicates = 0;
+static struct duplicate_slot slots[DUPLICATE_SLOTS];
+
+/* For every source that we have recently heard from through a
+   neighbour, the neighbour in question.  Packets addressed to that source
+   are unicast to the neighbour rather than flooded.  This is a
+   direct-mapped cache, a collision just causes a miss. */
+
+#define ROUTE_TIME 30
+#define NUMROUTES 1024
+
+struct route {
+    int domain;
+    unsigned char id[8];
+    struct sockaddr_in6 sin;
+    int hops;
+    time_t time;
+};
+
+static struct route routes[NUMROUTES];
+
+/* A token bucket per source id and class of traffic, so that a single
+   node cannot monopolise the forwarders or the server.  Buckets hold
+   milliseconds of credit; a packet costs RATE_COST, and a full bucket
+   allows a burst of RATE_BURST packets.  The table is direct-mapped, a
+   collision gives the newcomer a full bucket. */
+
+#define RATE_COST 1000
+#define RATE_BURST 10
+#define NUMBUCKETS 4096
+
+struct bucket {
+    unsigned char id[8];
     struct timeval time;
-    unsigned char src[8];
-    unsigned char dest[8];
-    unsigned char nonce[4];
+    int credit;
 };
 
-struct duplicate duplicate[NUMDUPLICATE];
-int next_duplicate = 0;
+static struct bucket buckets[2][NUMBUCKETS];
+static unsigned long rate_dropped[2];
+
+/* Packets waiting to be sent, in a binary heap ordered by time. */
 
+#define MAX_QUEUED 512
+
+struct queued_packet {
+    struct timeval time;
+    struct sockaddr_in6 sin;
+    int sinlen;                 /* 0 to multicast on all interfaces */
+    unsigned char hopcount, original_hopcount;
+    unsigned char header[20];   /* nonce, source, destination */
+    unsigned char *data;
+    size_t datalen;
+    int reply;                  /* a reply generated by this node */
+    int ingress;                /* for forwarded packets, see below */
+    int domain;
+    struct duplicate *duplicate;        /* for forwarded packets */
+    int copies;                 /* copies overheard while waiting */
+};
+
+static struct queued_packet *packet_queue[MAX_QUEUED];
+static int numqueued = 0;
+
+/* Outgoing messages are gathered into a batch, which is sent with
+   a single system call where possible.  The data must remain valid until
+   the batch is flushed. */
+
+#define MAX_BATCH 64
+
+#ifdef HAVE_SENDMMSG
+static struct mmsghdr batch[MAX_BATCH];
+#define BATCH_MSG(i) (batch[i].msg_hdr)
+#else
+static struct msghdr batch[MAX_BATCH];
+#define BATCH_MSG(i) (batch[i])
+#endif
+static struct iovec batch_iov[MAX_BATCH][2];
+static unsigned char batch_header[MAX_BATCH][24];
+static struct sockaddr_in6 batch_sin[MAX_BATCH];
+static int batchlen = 0;
+static int batch_domain = 0;    /* all messages in a batch share a socket */
+
+/* Returns the number of messages sent; sets errno if that is 0. */
 static int
-really_send_packet(struct sockaddr *sin, int sinlen,
-                   unsigned char hopcount, unsigned char original_hopcount,
-                   const unsigned char *nonce,
-                   const unsigned char *src, const unsigned char *dest,
-                   const unsigned char *data, size_t datalen)
+flush_batch(void)
 {
-    struct iovec iovec[2];
-    struct msghdr msg;
-    unsigned char header[24];
-    int rc, ret;
+    int i = 0, rc, sent = 0, saved_errno = 0;
+
+    /* No socket when replaying a capture; pretend we sent. */
+    if(domains[batch_domain].socket < 0) {
+        sent = batchlen;
+        batchlen = 0;
+        return sent;
+    }
 
+    while(i < batchlen) {
+#ifdef HAVE_SENDMMSG
+        rc = sendmmsg(domains[batch_domain].socket,
+                      batch + i, batchlen - i, 0);
+#else
+        rc = sendmsg(domains[batch_domain].socket, &batch[i], 0);
+        if(rc >= 0)
+            rc = 1;
+#endif
+        if(rc < 0) {
+            /* The first message failed, skip it. */
+            saved_errno = errno;
+            perror("send");
+            i++;
+        } else {
+            sent += rc;
+            i += rc;
+        }
+    }
+
+    batchlen = 0;
+    if(sent == 0)
+        errno = saved_errno ? saved_errno : EHOSTUNREACH;
+    return sent;
+}
+
+static void
+batch_message(int domain, const struct sockaddr *sin, int sinlen,
+              unsigned char hopcount, unsigned char original_hopcount,
+              const unsigned char *nonce,
+              const unsigned char *src, const unsigned char *dest,
+              const unsigned char *data, size_t datalen)
+{
+    unsigned char *header;
+    struct msghdr *msg;
+
+    if(batchlen >= MAX_BATCH || (batchlen > 0 && domain != batch_domain))
+        flush_batch();
+    batch_domain = domain;
+
+    header = batch_header[batchlen];
     header[0] = 43;
     header[1] = 1;
     header[2] = hopcount;
@@ -69,51 +241,97 @@ really_send_packet(struct sockaddr *sin, int sinlen,
     memcpy(header + 4, nonce, 4);
     memcpy(header + 8, src, 8);
     memcpy(header + 16, dest ? dest : ones, 8);
-    iovec[0].iov_base = (void*)header;
-    iovec[0].iov_len = sizeof(header);
-    iovec[1].iov_base = (void*)data;
-    iovec[1].iov_len = datalen;
-
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_iov = iovec;
-    msg.msg_iovlen = 2;
-    if(sin) {
-        msg.msg_name = sin;
-        msg.msg_namelen = sinlen;
-        rc = sendmsg(protocol_socket, &msg, 0);
-        if(rc < 0) {
-            int save = errno;
-            perror("send");
-            errno = save;
-            return -1;
-        }
+    batch_iov[batchlen][0].iov_base = (void*)header;
+    batch_iov[batchlen][0].iov_len = 24;
+    batch_iov[batchlen][1].iov_base = (void*)data;
+    batch_iov[batchlen][1].iov_len = datalen;
+
+    memcpy(&batch_sin[batchlen], sin, sinlen);
+    msg = &BATCH_MSG(batchlen);
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &batch_sin[batchlen];
+    msg->msg_namelen = sinlen;
+    msg->msg_iov = batch_iov[batchlen];
+    msg->msg_iovlen = 2;
+    batchlen++;
+}
+
+/* The network a forwarded packet came from, or one of these. */
+#define INGRESS_LOCAL (-1)      /* not forwarded, originated here */
+#define INGRESS_UNKNOWN (-2)    /* forwarded from an unknown network */
+
+/* Whether a packet from ingress may be sent out on network i. */
+static int
+egress_allowed(int ingress, int i)
+{
+    if(ingress == INGRESS_LOCAL)
         return 1;
-    } else {
-        int i, saved_errno = EHOSTUNREACH;
-        ret = -1;
-        for(i = 0; i < numnetworks; i++) {
-            struct sockaddr_in6 sin6;
-            if(networks[i].ifindex <= 0)
-                continue;
-            memset(&sin6, 0, sizeof(sin6));
-            sin6.sin6_family = AF_INET6;
-            memcpy(&sin6.sin6_addr, &protocol_group, 16);
-            sin6.sin6_port = htons(protocol_port);
-            sin6.sin6_scope_id = networks[i].ifindex;
-            msg.msg_name = (struct sockaddr*)&sin6;
-            msg.msg_namelen = sizeof(sin6);
-            rc = sendmsg(protocol_socket, &msg, 0);
-            if(rc < 0) {
-                saved_errno = errno;
-                perror("send");
-                /* but don't reset ret -- only return -1 if all sends failed. */
-            } else {
-                ret = 1;
+    if(!networks[i].forward)
+        return 0;
+    if(i == ingress && networks[i].split_horizon)
+        return 0;
+    return 1;
+}
+
+/* Add a packet to the batch, once per interface if sin is NULL.  Returns
+   the number of messages added. */
+static int
+batch_packet(int domain, struct sockaddr *sin, int sinlen, int ingress,
+             unsigned char hopcount, unsigned char original_hopcount,
+             const unsigned char *nonce,
+             const unsigned char *src, const unsigned char *dest,
+             const unsigned char *data, size_t datalen)
+{
+    int i, n = 0;
+
+    if(sin) {
+        if(sinlen > (int)sizeof(struct sockaddr_in6))
+            return 0;
+        if(ingress != INGRESS_LOCAL && sin->sa_family == AF_INET6) {
+            int ifindex = ((struct sockaddr_in6*)sin)->sin6_scope_id;
+            for(i = 0; i < numnetworks; i++) {
+                if(ifindex > 0 && networks[i].ifindex == ifindex &&
+                   !networks[i].forward)
+                    return 0;
             }
-            errno = saved_errno;
         }
-        return ret;
+        batch_message(domain, sin, sinlen, hopcount, original_hopcount,
+                      nonce, src, dest, data, datalen);
+        return 1;
+    }
+
+    for(i = 0; i < numnetworks; i++) {
+        if(networks[i].ifindex <= 0 || !egress_allowed(ingress, i))
+            continue;
+        batch_message(domain, (struct sockaddr*)&networks[i].group[domain],
+                      sizeof(struct sockaddr_in6),
+                      hopcount, original_hopcount,
+                      nonce, src, dest, data, datalen);
+        n++;
     }
+    return n;
+}
+
+static int
+really_send_packet(struct sockaddr *sin, int sinlen,
+                   unsigned char hopcount, unsigned char original_hopcount,
+                   const unsigned char *nonce,
+                   const unsigned char *src, const unsigned char *dest,
+                   const unsigned char *data, size_t datalen)
+{
+    int n, rc;
+
+    n = batch_packet(0, sin, sinlen, INGRESS_LOCAL,
+                     hopcount, original_hopcount,
+                     nonce, src, dest, data, datalen);
+    if(n == 0) {
+        errno = sin ? EINVAL : EHOSTUNREACH;
+        return -1;
+    }
+
+    /* Only return -1 if all sends failed. */
+    rc = flush_batch();
+    return rc > 0 ? 1 : -1;
 }
 
 int send_packet(struct sockaddr *sin, int sinlen,
@@ -133,39 +351,457 @@ int send_packet(struct sockaddr *sin, int sinlen,
                               buf, bufsize);
 }
 
-static int
-check_duplicate(const unsigned char *header)
+static void
+heap_swap(int i, int j)
 {
+    struct queued_packet *p = packet_queue[i];
+    packet_queue[i] = packet_queue[j];
+    packet_queue[j] = p;
+}
+
+static void
+heap_up(int i)
+{
+    while(i > 0 &&
+          timeval_compare(&packet_queue[(i - 1) / 2]->time,
+                          &packet_queue[i]->time) > 0) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void
+heap_down(int i)
+{
+    int j;
+
+    while(2 * i + 1 < numqueued) {
+        j = 2 * i + 1;
+        if(j + 1 < numqueued &&
+           timeval_compare(&packet_queue[j + 1]->time,
+                           &packet_queue[j]->time) < 0)
+            j++;
+        if(timeval_compare(&packet_queue[i]->time,
+                           &packet_queue[j]->time) <= 0)
+            break;
+        heap_swap(i, j);
+        i = j;
+    }
+}
+
+/* Queue a packet to be sent in usecs microseconds. */
+static struct queued_packet *
+queue_packet(struct sockaddr *sin, int sinlen,
+             unsigned char hopcount, unsigned char original_hopcount,
+             const unsigned char *nonce,
+             const unsigned char *src, const unsigned char *dest,
+             const unsigned char *data, size_t datalen, int usecs)
+{
+    struct queued_packet *p;
+
+    if(numqueued >= MAX_QUEUED || sinlen > (int)sizeof(p->sin)) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    p = malloc(sizeof(struct queued_packet));
+    if(p == NULL)
+        return NULL;
+    p->data = malloc(datalen);
+    if(p->data == NULL) {
+        free(p);
+        return NULL;
+    }
+
+    usecs += now.tv_usec;
+    p->time.tv_sec = now.tv_sec + usecs / 1000000;
+    p->time.tv_usec = usecs % 1000000;
+    if(sin)
+        memcpy(&p->sin, sin, sinlen);
+    p->sinlen = sin ? sinlen : 0;
+    p->hopcount = hopcount;
+    p->original_hopcount = original_hopcount;
+    memcpy(p->header, nonce, 4);
+    memcpy(p->header + 4, src, 8);
+    memcpy(p->header + 12, dest ? dest : ones, 8);
+    memcpy(p->data, data, datalen);
+    p->datalen = datalen;
+    p->reply = 0;
+    p->ingress = INGRESS_LOCAL;
+    p->domain = 0;
+    p->duplicate = NULL;
+    p->copies = 0;
+
+    packet_queue[numqueued++] = p;
+    heap_up(numqueued - 1);
+    return p;
+}
+
+/* Send a packet of ours after a delay.  If a reply to the same
+   destination is still queued, which happens when a client retransmits,
+   it is replaced, but keeps its place in the queue. */
+int
+send_packet_delayed(struct sockaddr *sin, int sinlen,
+                    const unsigned char *dest, int hopcount,
+                    const unsigned char *buf, size_t bufsize, int usecs)
+{
+    unsigned char nonce[4];
+    struct queued_packet *p;
+    unsigned char *data;
     int i;
-    struct timeval now;
-    gettime(&now, NULL);
-    for(i = 0; i < NUMDUPLICATE; i++) {
-        if(duplicate[i].time.tv_sec < now.tv_sec - 120)
+
+    if(hopcount <= 0)
+        return 0;
+
+    for(i = 0; i < numqueued; i++) {
+        p = packet_queue[i];
+        if(!p->reply || memcmp(p->header + 12, dest ? dest : ones, 8) != 0)
             continue;
-        if(memcmp(header + 4, duplicate[i].nonce, 4) == 0 &&
-           memcmp(header + 8, duplicate[i].src, 8) == 0 &&
-           memcmp(header + 16, duplicate[i].dest, 8) == 0)
-            return 1;
+        if(sinlen > (int)sizeof(p->sin))
+            return -1;
+        data = realloc(p->data, bufsize);
+        if(data == NULL)
+            return -1;
+        memcpy(data, buf, bufsize);
+        p->data = data;
+        p->datalen = bufsize;
+        if(sin)
+            memcpy(&p->sin, sin, sinlen);
+        p->sinlen = sin ? sinlen : 0;
+        p->hopcount = p->original_hopcount = hopcount;
+        debugf(3, "Replaced queued reply.\n");
+        return 1;
+    }
+
+    memcpy(nonce, &myseqno, 4);
+    myseqno++;
+
+    p = queue_packet(sin, sinlen, hopcount, hopcount, nonce, myid, dest,
+                     buf, bufsize, usecs);
+    if(p == NULL)
+        return -1;
+    p->reply = 1;
+    return 1;
+}
+
+void
+send_queued_packets(void)
+{
+    struct queued_packet *p, *done[MAX_QUEUED];
+    int i, n = 0;
+
+    while(numqueued > 0 &&
+          timeval_compare(&packet_queue[0]->time, &now) <= 0) {
+        p = packet_queue[0];
+        packet_queue[0] = packet_queue[--numqueued];
+        heap_down(0);
+
+        if(p->duplicate)
+            p->duplicate->forward = NULL;
+        done[n++] = p;
+
+        if(flood_threshold > 0 && p->copies >= flood_threshold) {
+            debugf(3, "Suppressed forwarding (%d copies heard).\n",
+                   p->copies);
+            continue;
+        }
+
+        batch_packet(p->domain,
+                     p->sinlen ? (struct sockaddr*)&p->sin : NULL,
+                     p->sinlen, p->ingress,
+                     p->hopcount, p->original_hopcount,
+                     p->header, p->header + 4, p->header + 12,
+                     p->data, p->datalen);
+    }
+
+    if(n == 0)
+        return;
+
+    if(batchlen > 0)
+        flush_batch();
+
+    for(i = 0; i < n; i++) {
+        free(done[i]->data);
+        free(done[i]);
     }
-    return 0;
 }
 
+/* The number of packets that can still be queued. */
+int
+send_queue_space(void)
+{
+    return MAX_QUEUED - numqueued;
+}
+
+/* Unicast a client message to each of the servers we relay to.  The
+   servers should handle it but not forward it, so the hop count is 1.
+   The original hop count is incremented so that the reply can make it
+   back to the client through us, and it is delivered along the route
+   learned from the client's message. */
 static void
-record_duplicate(const unsigned char *header)
+relay_packet(const unsigned char *buf, size_t buflen)
 {
-    memcpy(duplicate[next_duplicate].nonce, header + 4, 4);
-    memcpy(duplicate[next_duplicate].src, header + 8, 8);
-    memcpy(duplicate[next_duplicate].dest, header + 16, 8);
-    gettime(&duplicate[next_duplicate].time, NULL);
+    struct queued_packet *p;
+    int i;
 
-    next_duplicate = (next_duplicate + 1) % NUMDUPLICATE;
+    debugf(2, "Relaying packet to %d server%s.\n",
+           numrelays, numrelays == 1 ? "" : "s");
+
+    for(i = 0; i < numrelays; i++) {
+        p = queue_packet((struct sockaddr*)&relays[i], sizeof(relays[i]),
+                         1, buf[3] < 255 ? buf[3] + 1 : 255,
+                         buf + 4, buf + 8, buf + 16,
+                         buf + 24, buflen - 24, 0);
+        if(p == NULL)
+            debugf(1, "Couldn't queue packet for relaying.\n");
+    }
+}
+
+int
+relay_add(const char *address, int port)
+{
+    struct sockaddr_in6 *sin6;
+    unsigned char ipv4[4];
+    int rc;
+
+    if(numrelays >= MAX_RELAYS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    sin6 = &relays[numrelays];
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    rc = inet_pton(AF_INET6, address, &sin6->sin6_addr);
+    if(rc <= 0) {
+        rc = inet_pton(AF_INET, address, ipv4);
+        if(rc <= 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(&sin6->sin6_addr, v4prefix, 12);
+        memcpy((unsigned char*)&sin6->sin6_addr + 12, ipv4, 4);
+    }
+
+    numrelays++;
+    return 1;
+}
+
+void
+transport_timeout(struct timeval *tv)
+{
+    if(numqueued > 0)
+        timeval_min(tv, &packet_queue[0]->time);
+}
+
+static unsigned
+hash_id(const unsigned char *id, int len)
+{
+    unsigned h = 2166136261U;
+    int i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ id[i]) * 16777619U;
+    return h;
+}
+
+static int
+resize_duplicates(unsigned n)
+{
+    struct duplicate **new, *d, *next;
+    unsigned i;
+
+    new = calloc(n, sizeof(struct duplicate*));
+    if(new == NULL)
+        return -1;
+
+    for(i = 0; i < numbuckets; i++) {
+        for(d = duplicates[i]; d; d = next) {
+            next = d->next;
+            d->next = new[d->hash & (n - 1)];
+            new[d->hash & (n - 1)] = d;
+        }
+    }
+
+    free(duplicates);
+    duplicates = new;
+    numbuckets = n;
+    return 1;
+}
+
+static void
+expire_slot(struct duplicate_slot *slot)
+{
+    struct duplicate *d, **p;
+
+    while(slot->first) {
+        d = slot->first;
+        slot->first = d->next_slot;
+        p = &duplicates[d->hash & (numbuckets - 1)];
+        while(*p != d)
+            p = &(*p)->next;
+        *p = d->next;
+        if(d->forward)
+            d->forward->duplicate = NULL;
+        free(d);
+        numduplicates--;
+    }
+
+    if(numbuckets > MIN_DUPLICATE_BUCKETS && numduplicates < numbuckets / 4)
+        resize_duplicates(numbuckets / 2);
+}
+
+/* Make room when the table is full, which only happens under a flood. */
+static void
+expire_oldest_slot(void)
+{
+    struct duplicate_slot *oldest = NULL;
+    int i;
+
+    for(i = 0; i < DUPLICATE_SLOTS; i++) {
+        if(slots[i].first &&
+           (oldest == NULL || slots[i].start < oldest->start))
+            oldest = &slots[i];
+    }
+    if(oldest)
+        expire_slot(oldest);
+}
+
+static struct duplicate *
+find_duplicate(int domain, const unsigned char *header)
+{
+    struct duplicate *d;
+    unsigned h;
+
+    if(numbuckets == 0)
+        return NULL;
+
+    h = hash_id(header + 4, 20) ^ domain;
+    for(d = duplicates[h & (numbuckets - 1)]; d; d = d->next) {
+        if(d->hash == h && d->time >= now.tv_sec - DUPLICATE_TIME &&
+           d->domain == domain && memcmp(d->id, header + 4, 20) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+static struct duplicate *
+record_duplicate(int domain, const unsigned char *header)
+{
+    struct duplicate_slot *slot;
+    struct duplicate *d;
+    time_t start = now.tv_sec - now.tv_sec % DUPLICATE_SLOT;
+
+    slot = &slots[(now.tv_sec / DUPLICATE_SLOT) % DUPLICATE_SLOTS];
+    if(slot->start != start) {
+        expire_slot(slot);
+        slot->start = start;
+    }
+
+    if(numduplicates >= MAX_DUPLICATES) {
+        debugf(2, "Duplicate table full, expiring early.\n");
+        expire_oldest_slot();
+    }
+
+    if(numduplicates >= numbuckets && numbuckets < MAX_DUPLICATE_BUCKETS)
+        resize_duplicates(MAX(numbuckets * 2, MIN_DUPLICATE_BUCKETS));
+
+    if(numbuckets == 0)
+        return NULL;
+
+    d = malloc(sizeof(struct duplicate));
+    if(d == NULL) {
+        perror("malloc(duplicate)");
+        return NULL;
+    }
+
+    d->domain = domain;
+    memcpy(d->id, header + 4, 20);
+    d->hash = hash_id(d->id, 20) ^ domain;
+    d->time = now.tv_sec;
+    d->forward = NULL;
+    d->next = duplicates[d->hash & (numbuckets - 1)];
+    duplicates[d->hash & (numbuckets - 1)] = d;
+    d->next_slot = slot->first;
+    slot->first = d;
+    numduplicates++;
+    return d;
+}
+
+static struct route *
+find_route(int domain, const unsigned char *id)
+{
+    struct route *route = &routes[(hash_id(id, 8) ^ domain) % NUMROUTES];
+
+    if(route->time == 0 || route->time < now.tv_sec - ROUTE_TIME ||
+       route->domain != domain || memcmp(route->id, id, 8) != 0)
+        return NULL;
+    return route;
+}
+
+/* Keep the shortest path until it times out. */
+static void
+learn_route(int domain, const unsigned char *id,
+            const struct sockaddr_in6 *from, int hops)
+{
+    struct route *route = find_route(domain, id);
+
+    if(route && route->hops < hops)
+        return;
+
+    route = &routes[(hash_id(id, 8) ^ domain) % NUMROUTES];
+    route->domain = domain;
+    memcpy(route->id, id, 8);
+    memcpy(&route->sin, from, sizeof(route->sin));
+    route->hops = hops;
+    route->time = now.tv_sec;
+}
+
+/* Returns 1 if a packet of the given class from id may be processed. */
+int
+rate_check(int class, const unsigned char *id)
+{
+    struct bucket *b = &buckets[class][hash_id(id, 8) % NUMBUCKETS];
+    int ms;
+
+    if(b->time.tv_sec == 0 || memcmp(b->id, id, 8) != 0) {
+        memcpy(b->id, id, 8);
+        b->credit = RATE_BURST * RATE_COST;
+    } else {
+        ms = timeval_minus_msec(&now, &b->time);
+        b->credit = MIN(b->credit + ms, RATE_BURST * RATE_COST);
+    }
+    b->time = now;
+
+    if(b->credit < RATE_COST) {
+        rate_dropped[class]++;
+        return 0;
+    }
+
+    b->credit -= RATE_COST;
+    return 1;
+}
+
+void
+rate_dump(void)
+{
+    printf("Rate limiting dropped %lu forwarded packets and %lu requests.\n",
+           rate_dropped[RATE_FORWARD], rate_dropped[RATE_REPLY]);
 }
 
 /* Take an incoming packet, forward it if necessary, return 2 if it needs
-   to be handled by the local node. */
+   to be handled by the local node.  Domain is the domain it belongs to,
+   net the network it arrived on, or -1, and from the neighbour we
+   received it from if ll is true.  Multicast is true if it was sent to
+   a multicast group. */
 int
-handle_packet(int ll, const unsigned char *buf, size_t buflen)
+handle_packet(int domain, int net, int ll, int multicast,
+              const struct sockaddr_in6 *from,
+              const unsigned char *buf, size_t buflen)
 {
+    struct duplicate *d;
+
     if(buflen < 2) {
         debugf(1, "Received truncated packet.\n");
         return 0;
@@ -208,25 +844,67 @@ handle_packet(int ll, const unsigned char *buf, size_t buflen)
         return 0;
     }
 
-    if(check_duplicate(buf)) {
+    d = find_duplicate(domain, buf);
+    if(d) {
+        if(d->forward)
+            d->forward->copies++;
         debugf(3, "Suppressed duplicate.\n");
         return 0;
     }
 
-    record_duplicate(buf);
+    d = record_duplicate(domain, buf);
+
+    if(ll && from)
+        learn_route(domain, buf + 8, from, buf[3] - buf[2] + 1);
 
     if(memcmp(buf + 16, myid, 8) == 0)
         return 2;
 
-    if(buf[2] >= 2) {
-        debugf(2, "Forwarding packet, %d/%d hops left.\n",
-               buf[2] - 1, buf[3]);
+    /* Only flooded packets, which come from clients, are limited. */
+    if(!forwarding || (multicast && !forward_multicast) ||
+       (net >= 0 && !networks[net].forward)) {
+        /* Nothing. */
+    } else if(numrelays > 0 && domain == 0 && buflen > 24 &&
+              (buf[24] == AHCP_DISCOVER || buf[24] == AHCP_REQUEST ||
+               buf[24] == AHCP_RELEASE)) {
+        if(!rate_check(RATE_FORWARD, buf + 8))
+            debugf(2, "Not relaying packet, source over its rate.\n");
+        else
+            relay_packet(buf, buflen);
+    } else if(buf[2] >= 2 && memcmp(buf + 16, ones, 8) == 0 &&
+              !rate_check(RATE_FORWARD, buf + 8)) {
+        debugf(2, "Not forwarding packet, source over its rate.\n");
+    } else if(buf[2] >= 2) {
+        struct queued_packet *p;
+        struct route *route = NULL;
+
+        if(memcmp(buf + 16, ones, 8) != 0) {
+            route = find_route(domain, buf + 16);
+            /* Don't send it back where it came from. */
+            if(route && ll && from &&
+               memcmp(&route->sin.sin6_addr, &from->sin6_addr, 16) == 0 &&
+               route->sin.sin6_scope_id == from->sin6_scope_id)
+                route = NULL;
+        }
 
-        usleep(random() % 50000);
-        really_send_packet(NULL, 0,
-                           buf[2] - 1, buf[3],
-                           buf + 4, buf + 8, buf + 16,
-                           buf + 24, buflen - 24);
+        debugf(2, "Forwarding packet, %d/%d hops left%s.\n",
+               buf[2] - 1, buf[3], route ? " (unicast)" : "");
+
+        p = queue_packet(route ? (struct sockaddr*)&route->sin : NULL,
+                         route ? sizeof(route->sin) : 0,
+                         buf[2] - 1, buf[3],
+                         buf + 4, buf + 8, buf + 16,
+                         buf + 24, buflen - 24, random() % 50000);
+        if(p == NULL) {
+            debugf(1, "Couldn't queue packet for forwarding.\n");
+        } else {
+            p->ingress = net >= 0 ? net : INGRESS_UNKNOWN;
+            p->domain = domain;
+            if(d && flood_threshold > 0) {
+                d->forward = p;
+                p->duplicate = d;
+            }
+        }
     }
 
     if(memcmp(buf + 16, ones, 8) == 0)
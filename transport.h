@@ -21,8 +21,27 @@ THE SOFTWARE.
 */
 
 extern unsigned myseqno;
+extern int flood_threshold;
+extern int forwarding, forward_multicast;
+
+#define RATE_FORWARD 0
+#define RATE_REPLY 1
+
+/* How long, in seconds, a packet is remembered to suppress duplicates. */
+#define DUPLICATE_TIME 120
 
 int send_packet(struct sockaddr *sin, int sinlen,
                 const unsigned char *dest, int hopcount,
                 const unsigned char *buf, size_t bufsize);
-int handle_packet(int ll, const unsigned char *buf, size_t buflen);
+int send_packet_delayed(struct sockaddr *sin, int sinlen,
+                        const unsigned char *dest, int hopcount,
+                        const unsigned char *buf, size_t bufsize, int usecs);
+int handle_packet(int domain, int net, int ll, int multicast,
+                  const struct sockaddr_in6 *from,
+                  const unsigned char *buf, size_t buflen);
+void send_queued_packets(void);
+int send_queue_space(void);
+void transport_timeout(struct timeval *tv);
+int relay_add(const char *address, int port);
+int rate_check(int class, const unsigned char *id);
+void rate_dump(void);